@@ -0,0 +1,114 @@
+/* Benchmark for the GTP response parser
+ *
+ * Copyright 2020-2021 Philip Kaludercic
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "gtp.h"
+
+/* expected by gtp.c */
+bool verbose;
+bool debug;
+char *komi;
+
+/* Write synthetic engine output of about SIZE bytes to F, and return
+ * the number of responses written. */
+static size_t
+generate(FILE *f, size_t size)
+{
+     size_t n = 0, i;
+     long pos;
+
+     srand(0);
+     while ((pos = ftell(f)) >= 0 && (size_t) pos < size) {
+          n++;
+          switch (rand() % 10) {
+          case 0:               /* showboard-like response */
+               fprintf(f, "=%zu \n", n);
+               for (i = 0; i < 19; i++) {
+                    fprintf(f, "%2zu . . . X . . . O . . . . . . . . . . . %2zu\n",
+                            19 - i, 19 - i);
+               }
+               fputs("\n", f);
+               break;
+          case 1:               /* analysis output, with CRLF */
+               fprintf(f, "=%zu\r\n", n);
+               for (i = 0; i < 40; i++) {
+                    fprintf(f, "info move D%zu visits %d winrate %d pv D4 Q16 C3\r\n",
+                            i % 19 + 1, rand() % 1000, rand() % 10000);
+               }
+               fputs("\r\n", f);
+               break;
+          case 2:
+               fprintf(f, "?%zu invalid move\n\n", n);
+               break;
+          case 3:
+               fprintf(f, "=%zu\tD4 # comment\n\n", n);
+               break;
+          default:
+               fprintf(f, "=%zu Q16\n\n", n);
+          }
+     }
+
+     return n;
+}
+
+int
+main(int argc, char *argv[])
+{
+     size_t size = (argc > 1 ? strtoul(argv[1], NULL, 10) : 64) << 20;
+     size_t expect, got = 0, bytes = 0, errors = 0;
+     uint64_t start;
+     struct Reader r = {0};
+     struct Response resp;
+     double secs;
+     ssize_t n;
+     FILE *f;
+
+     f = tmpfile();
+     if (!f) {
+          perror("tmpfile");
+          return EXIT_FAILURE;
+     }
+     expect = generate(f, size);
+     fflush(f);
+     size = ftell(f);
+     rewind(f);
+
+     start = clock_now_us();
+     do {
+          while (gtp_next(&r, &resp)) {
+               got++;
+               bytes += resp.len;
+               errors += resp.error || resp.malformed;
+          }
+     } while ((n = gtp_fill(&r, fileno(f))) > 0);
+     secs = (clock_now_us() - start) / 1e6;
+
+     printf("parsed %zu/%zu responses (%zu errors, %zu bytes of text)\n",
+            got, expect, errors, bytes);
+     printf("%.1f MiB in %.3f s: %.1f MiB/s, %.0f responses/s, buffer %zu bytes\n",
+            size / 1048576.0, secs, size / 1048576.0 / secs, got / secs, r.cap);
+
+     free(r.buf);
+     fclose(f);
+     return got == expect ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -25,6 +25,8 @@
 #include <string.h>
 
 #include "board.h"
+#include "history.h"
+#include "journal.h"
 
 #define LENGTH(a) ((unsigned) (sizeof(a)/sizeof(*a)))
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
@@ -41,6 +43,159 @@
       (c).x >= (b)->width ||                            \
       (c).y >= (b)->height)
 
+/* Zobrist keys for every stone and vertex of the largest supported
+ * board.  They are derived from a fixed seed, so that hashes are
+ * stable between runs and may be stored on disk. */
+static uint64_t zobrist[2][25 * 25];
+static uint64_t zobrist_side;
+
+static uint64_t
+splitmix64(uint64_t *x)
+{
+     uint64_t z = (*x += 0x9e3779b97f4a7c15);
+     z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+     z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+     return z ^ (z >> 31);
+}
+
+static void
+zobrist_init(void)
+{
+     uint64_t seed = 0x53676f21;
+     uint16_t i;
+
+     if (zobrist_side) {
+          return;
+     }
+
+     for (i = 0; i < LENGTH(zobrist[0]); i++) {
+          zobrist[0][i] = splitmix64(&seed);
+          zobrist[1][i] = splitmix64(&seed);
+     }
+     zobrist_side = splitmix64(&seed);
+}
+
+/* Map COORD on BOARD according to transformation T (see board.h).
+ * The colour bit is ignored. */
+struct Coord
+transform_coord(struct Board *b, uint8_t t, struct Coord c)
+{
+     uint8_t tmp;
+
+     if (t & T_SWAP_XY) {
+          assert(b->width == b->height);
+          tmp = c.x;
+          c.x = c.y;
+          c.y = tmp;
+     }
+     if (t & T_FLIP_X) {
+          c.x = b->width - 1 - c.x;
+     }
+     if (t & T_FLIP_Y) {
+          c.y = b->height - 1 - c.y;
+     }
+
+     return c;
+}
+
+/* Inverse of transform_coord, i.e. map a coordinate in the
+ * transformed position back onto BOARD. */
+struct Coord
+untransform_coord(struct Board *b, uint8_t t, struct Coord c)
+{
+     uint8_t tmp;
+
+     if (t & T_FLIP_X) {
+          c.x = b->width - 1 - c.x;
+     }
+     if (t & T_FLIP_Y) {
+          c.y = b->height - 1 - c.y;
+     }
+     if (t & T_SWAP_XY) {
+          tmp = c.x;
+          c.x = c.y;
+          c.y = tmp;
+     }
+
+     return c;
+}
+
+/* Add or remove STONE at COORD from all symmetric hashes of BOARD.
+ * As XOR is its own inverse, both cases are the same operation. */
+static void
+toggle_hashes(struct Board *b, struct Coord c, enum Stone s)
+{
+     struct Coord tc;
+     uint8_t t;
+
+     if (s == NONE) {
+          return;
+     }
+
+     for (t = 0; t < T_COLOUR; t++) {
+          if ((t & T_SWAP_XY) && b->width != b->height) {
+               continue;
+          }
+
+          tc = transform_coord(b, t, c);
+          b->hash[t] ^= zobrist[s - BLACK][tc.y * 25 + tc.x];
+          b->hash[t | T_COLOUR] ^= zobrist[opposite(s) - BLACK][tc.y * 25 + tc.x];
+     }
+}
+
+/* Replace whatever is at COORD on BOARD with STONE, keeping the
+ * hashes up to date. */
+static void
+set_stone(struct Board *b, struct Coord c, enum Stone s)
+{
+     toggle_hashes(b, c, stone_at(b, c));
+     stone_at(b, c) = s;
+     toggle_hashes(b, c, s);
+}
+
+/* Calculate a canonical key for the position on BOARD with STONE to
+ * move.
+ *
+ * All symmetric variants of a position have the same key.  If
+ * COLOURS is true, so does the one with swapped colours and the other
+ * player to move, which is only equivalent if komi doesn't matter.
+ * If non-NULL, the transformation that maps the position onto its
+ * canonical variant is stored in the fourth argument.  Moves from the
+ * canonical position can be mapped back using untransform_coord,
+ * remembering to swap the colour if T_COLOUR is set. */
+uint64_t
+board_key(struct Board *b, enum Stone s, bool colours, uint8_t *transform)
+{
+     uint64_t key, min = UINT64_MAX, dim;
+     uint8_t t, best = 0;
+
+     assert(s == BLACK || s == WHITE);
+
+     /* positions on different board sizes may never collide */
+     dim = ((uint64_t) b->width << 8) | b->height;
+     dim = splitmix64(&dim);
+
+     for (t = 0; t < (colours ? SYMMETRIES : T_COLOUR); t++) {
+          if ((t & T_SWAP_XY) && b->width != b->height) {
+               continue;
+          }
+
+          key = b->hash[t] ^ dim;
+          if (((t & T_COLOUR) ? opposite(s) : s) == WHITE) {
+               key ^= zobrist_side;
+          }
+          if (key < min) {
+               min = key;
+               best = t;
+          }
+     }
+
+     if (transform) {
+          *transform = best;
+     }
+     return min;
+}
+
 /* Create and initialize board.
  *
  * Return non-NULL if successful, or NULL if an error occurs. Errno
@@ -53,6 +208,8 @@ make_board(uint8_t width, uint8_t height)
 
      assert(0 == NONE);
 
+     zobrist_init();
+
      if (width < 2 || width > 25 || height < 2 || height > 25) {
           errno = EINVAL;
           return NULL;
@@ -67,6 +224,10 @@ make_board(uint8_t width, uint8_t height)
      b->height = height;
      b->changed = true;
 
+     /* the root of the history, which all other moves follow */
+     b->history = history_alloc(0);
+     b->history->setup = true;
+
      return b;
 }
 
@@ -205,6 +366,28 @@ valid_move(struct Board *b, enum Stone s, struct Coord c)
      return false;
 }
 
+/* Find a move by STONE at COORD (or a pass) that has already been
+ * played after the current move on BOARD, so that playing it again
+ * follows the existing variation instead of creating a new one. */
+static struct Move *
+find_followup(struct Board *b, enum Stone s, struct Coord c, bool pass)
+{
+     struct Move *m;
+     uint16_t i;
+
+     for (i = 0; i < b->history->children; i++) {
+          m = b->history->after[i];
+          if (m->player == s && m->pass == pass &&
+              (pass || (m->placed.x == c.x && m->placed.y == c.y))) {
+               m = history_load(m);
+               history_follow(m);
+               return m;
+          }
+     }
+
+     return NULL;
+}
+
 /* Update BOARD after LAST_CHANGE */
 static int16_t
 update_board(struct Board *b, struct Coord last_change)
@@ -259,7 +442,7 @@ update_board(struct Board *b, struct Coord last_change)
 
                for (j = 0; j < LENGTH(group); j++) {
                     if (group[j]) {
-                         stone_at(b, P(b, j)) = NONE;
+                         set_stone(b, P(b, j), NONE);
                          removed[j] = true;
                     }
                }
@@ -272,19 +455,19 @@ update_board(struct Board *b, struct Coord last_change)
           }
      }
 
-     /* create new history object */
-     struct Move *move = malloc(sizeof(struct Move) + sizeof(struct Coord) * changed);
-     if (!move) {
-          perror("calloc");
-          abort();
+     /* reuse known variations */
+     struct Move *move = find_followup(b, stone_at(b, last_change),
+                                       last_change, false);
+     if (move) {
+          b->history = move;
+          history_checkpoint(b);
+          return (int16_t) changed;
      }
 
-     *move = (struct Move) {
-          .player = stone_at(b, last_change),
-          .placed = last_change,
-          .before = b->history,
-          .removed_n = changed - 1,
-     };
+     /* create new history object */
+     move = history_alloc(changed - 1);
+     move->player = stone_at(b, last_change);
+     move->placed = last_change;
 
      /* mark changed stones */
      for (j = i = 0; i < LENGTH(removed); i++) {
@@ -295,22 +478,13 @@ update_board(struct Board *b, struct Coord last_change)
      }
      /* assert(j == move->removed_n);  /\* changed = removed + (1) added *\/ */
 
-     if (b->history)  {
-          /* insert backlink */
-          b->history->after = realloc(
-               b->history->after,
-               sizeof(struct Move) * (b->history->children + 1)
-               );
-          if (!b->history->after) {
-               perror("realloc");
-               abort();
-          }
-          b->history->after[b->history->children] = move;
-          b->history->children += 1;
-     }
+     /* insert backlink */
+     history_link(b->history, move);
 
      /* save last move */
      b->history = move;
+     history_checkpoint(b);
+     history_trim(b);
 
      /* assert(changed < (1 << 15)); /\* prevent overflow *\/ */
 
@@ -331,17 +505,30 @@ undo_move(struct Board *b)
           return false;
      }
 
+     /* passing doesn't change the board */
+     if (move->pass) {
+          b->history = move->before;
+          if (b->journal) {
+               journal_append(b->journal, J_UNDO, move->player, move->placed);
+          }
+          return true;
+     }
+
      /* remove last placed stone */
-     stone_at(b, move->placed) = NONE;
+     set_stone(b, move->placed, NONE);
 
      /* add removed stones again */
      for (i = 0; i < move->removed_n; i++) {
-          stone_at(b, move->removed[i]) = opposite(move->player);
+          set_stone(b, move->removed[i], opposite(move->player));
      }
 
      /* save changed */
      b->history = move->before;
 
+     if (b->journal) {
+          journal_append(b->journal, J_UNDO, move->player, move->placed);
+     }
+
      /* update points */
      switch (move->player) {
      case WHITE:
@@ -360,21 +547,150 @@ undo_move(struct Board *b)
 void
 pass(struct Board *b, enum Stone s)
 {
-     struct Move *move = malloc(sizeof(struct Move));
+     struct Move *move = find_followup(b, s, C(0, 0), true);
+
      if (!move) {
+          move = history_alloc(0);
+          move->pass = true;
+          move->player = s;
+          history_link(b->history, move);
+     }
+
+     b->history = move;
+     history_checkpoint(b);
+     history_trim(b);
+
+     if (b->journal) {
+          journal_append(b->journal, J_PASS, s, C(0, 0));
+     }
+}
+
+
+/* Play move M again, which must follow the current move on BOARD. */
+static void
+redo_move(struct Board *b, struct Move *m)
+{
+     uint16_t i;
+
+     assert(m->before == b->history);
+     assert(resident(m));
+
+     if (!m->pass) {
+          set_stone(b, m->placed, m->player);
+          for (i = 0; i < m->removed_n; i++) {
+               set_stone(b, m->removed[i], NONE);
+          }
+
+          switch (m->player) {
+          case WHITE:
+               b->black_captured += m->removed_n;
+               break;
+          case BLACK:
+               b->white_captured += m->removed_n;
+               break;
+          default:
+               ;
+          }
+     }
+
+     history_follow(m);
+     b->history = m;
+     history_checkpoint(b);
+}
+
+/* Restore the position saved in the checkpoint of move M. */
+static void
+restore_checkpoint(struct Board *b, struct Move *m)
+{
+     struct Checkpoint *cp = m->checkpoint;
+
+     memcpy(b->board, cp->board, sizeof(enum Stone) * b->width * b->height);
+     memcpy(b->hash, cp->hash, sizeof(b->hash));
+     b->black_captured = cp->black_captured;
+     b->white_captured = cp->white_captured;
+     b->history = m;
+}
+
+/* Change the position on BOARD to the one after move TARGET.
+ *
+ * The board is transformed by undoing all moves up to the last
+ * common ancestor of the current move and TARGET, and then replaying
+ * the moves down to TARGET.  If a checkpoint on the way to TARGET is
+ * closer than the common ancestor, it is restored instead. */
+void
+goto_move(struct Board *b, struct Move *target)
+{
+     struct Journal *j = b->journal;
+     struct Move *m, *t, *cp, **path;
+     uint16_t up, down, n, i;
+
+     assert(resident(target));
+
+     /* find the last common ancestor */
+     for (m = b->history; m->depth > target->depth; m = m->before)
+          ;
+     for (t = target; t->depth > m->depth; t = t->before)
+          ;
+     while (m != t) {
+          m = m->before;
+          t = t->before;
+     }
+     up = b->history->depth - m->depth;
+     down = target->depth - m->depth;
+
+     /* find the closest checkpoint, that would need fewer steps
+      * (restoring a checkpoint is assumed to be as expensive as a few
+      * moves) */
+     for (cp = target, i = 0;
+          cp && !cp->checkpoint && i + 4 < up + down;
+          cp = cp->before, i++)
+          ;
+     if (cp && (!cp->checkpoint || i + 4 >= up + down)) {
+          cp = NULL;
+     }
+
+     path = malloc(sizeof(struct Move *) * (target->depth + 1));
+     if (!path) {
           perror("malloc");
           abort();
      }
 
-     *move = (struct Move) {
-          .pass = true,
-          .player = s,
-          .before = b->history,
-     };
+     /* the journal only records the logical steps, see below */
+     b->journal = NULL;
 
-     b->history = move;
-}
+     if (cp) {
+          restore_checkpoint(b, cp);
+     } else {
+          while (b->history != m) {
+               undo_move(b);
+          }
+     }
 
+     for (n = 0, t = target; t != b->history; t = t->before) {
+          path[n++] = t;
+     }
+     while (n > 0) {
+          redo_move(b, path[--n]);
+     }
+
+     b->journal = j;
+     if (j) {
+          for (i = 0; i < up; i++) {
+               journal_append(j, J_UNDO, NONE, C(0, 0));
+          }
+          for (n = 0, t = target; n < down; t = t->before) {
+               path[n++] = t;
+          }
+          while (n > 0) {
+               t = path[--n];
+               journal_append(j, t->pass ? J_PASS : J_PLACE,
+                              t->player, t->placed);
+          }
+     }
+
+     free(path);
+     b->changed = true;
+}
 
 /* Place STONE at COORD on BOARD.
  *
@@ -387,7 +703,11 @@ place_stone(struct Board *b, enum Stone s, struct Coord c)
           return -1;
      }
 
-     stone_at(b, c) = s;
+     set_stone(b, c, s);
+
+     if (b->journal) {
+          journal_append(b->journal, J_PLACE, s, c);
+     }
 
      return update_board(b, c);
 }
@@ -482,10 +802,9 @@ move_free(struct Move *m)
      for (i = 0; i < m->children; i++) {
           move_free(m->after[i]);
      }
-     free(m->after);
 
      /* then free the move object */
-     free(m);
+     history_release(m);
 }
 
 void
@@ -497,15 +816,13 @@ board_free(struct Board *b)
 
      /* find root history node */
      struct Move *m = b->history;
-     if (m) {
-          while (m->before) {
-               m = m->before;
-          }
-
-          /* recursivly free moves */
-          move_free(m);
+     while (m->before) {
+          m = m->before;
      }
 
+     /* recursivly free moves */
+     move_free(m);
+
      /* free board itself */
      free(b);
 }
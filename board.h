@@ -26,14 +26,28 @@ enum Stone {
      WHITE,
 };
 
+/* A position can be looked at in 8 ways (rotations and reflections of
+ * the board) with either colouring.  Each of these variants has its
+ * own Zobrist hash in struct Board, indexed by a transformation
+ * number: bit 0 mirrors the x axis, bit 1 the y axis, bit 2 swaps
+ * both axes (only meaningful on square boards) and bit 3 swaps the
+ * colours.  Transformation 0 is the identity. */
+#define SYMMETRIES 16
+#define T_FLIP_X   (1 << 0)
+#define T_FLIP_Y   (1 << 1)
+#define T_SWAP_XY  (1 << 2)
+#define T_COLOUR   (1 << 3)
+
 struct Board {
      uint8_t	width;
      uint8_t	height;
      uint16_t	black_captured;
      uint16_t	white_captured;
-     struct Move *history;
+     struct Move *history;      /* never NULL, see make_board */
+     struct Journal *journal;   /* optional, see journal.c */
      bool       changed;
      enum Stone      next;
+     uint64_t	hash[SYMMETRIES];
      enum Stone	board[];
 };
 
@@ -41,6 +55,18 @@ struct Coord {
      uint8_t x, y;
 };
 
+/* Full copy of a position, stored every CHECKPOINT moves to speed up
+ * jumping around in the history (see goto_move) */
+#define CHECKPOINT 32
+
+struct Checkpoint {
+     uint32_t	size;           /* in bytes */
+     uint16_t	black_captured;
+     uint16_t	white_captured;
+     uint64_t	hash[SYMMETRIES];
+     enum Stone	board[];
+};
+
 struct Move {
      enum Stone player;
      struct Coord placed;
@@ -50,7 +76,11 @@ struct Move {
      struct Move *before;
      struct Move **after;
      uint16_t	children;
-     
+     uint16_t	followed;       /* index of the last visited child */
+     uint16_t	depth;          /* distance from the root */
+     uint64_t	spill;          /* offset + 1 in spill file, see history.c */
+     struct Checkpoint *checkpoint;
+
      uint16_t	removed_n;
      struct Coord removed[];
 };
@@ -60,6 +90,7 @@ struct Move {
 #define I(b, C) ((C).y * (b)->width + (C).x)		    /* coord -> index */
 #define stone_at(b, c) (b->board[I(b, c)])
 #define opposite(s) ((s) == BLACK ? WHITE : (s) == WHITE ? BLACK : (abort(), s))
+#define board_hash(b) ((b)->hash[0])			    /* untransformed hash */
 
 struct Board	*make_board(uint8_t, uint8_t);
 bool	        valid_move(struct Board *, enum Stone, struct Coord);
@@ -67,6 +98,10 @@ void            pass(struct Board*, enum Stone);
 int16_t		place_stone(struct Board *, enum Stone, struct Coord);
 uint16_t	player_points(struct Board *, enum Stone);
 bool		undo_move(struct Board *);
+void		goto_move(struct Board *, struct Move *);
 void		board_free(struct Board *);
+uint64_t	board_key(struct Board *, enum Stone, bool, uint8_t *);
+struct Coord	transform_coord(struct Board *, uint8_t, struct Coord);
+struct Coord	untransform_coord(struct Board *, uint8_t, struct Coord);
 
 #endif
@@ -0,0 +1,187 @@
+/* Persistent cache for engine responses
+ *
+ * Copyright 2020-2021 Philip Kaludercic
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+/* The cache file is a plain sequence of fixed-size records, that is
+ * only ever appended to.  When opened, all records are loaded into a
+ * open-addressing hash table, so that lookups don't have to touch
+ * the disk.  Later records overwrite earlier ones with the same
+ * key.  Records are stored in host byte order. */
+
+struct Record {
+     uint64_t key;
+     uint8_t  type;
+     uint8_t  x, y;
+     uint8_t  pad[5];
+};
+
+static struct Record *table;
+static size_t cap, used;
+static int fd = -1;
+
+/* 0 marks an empty slot, so it may not be used as a key */
+#define fix_key(k) ((k) ? (k) : 1)
+
+static struct Record *
+slot(uint64_t key)
+{
+     size_t i;
+
+     assert(cap > 0 && (cap & (cap - 1)) == 0);
+     for (i = key & (cap - 1); table[i].key && table[i].key != key;
+          i = (i + 1) & (cap - 1))
+          ;
+
+     return &table[i];
+}
+
+static void
+insert(struct Record *r)
+{
+     struct Record *old = table, *s;
+     size_t i, n = cap;
+
+     /* keep the load factor below one half */
+     if ((used + 1) * 2 > cap) {
+          cap = cap ? cap * 2 : 1024;
+          table = calloc(cap, sizeof(struct Record));
+          if (!table) {
+               perror("calloc");
+               abort();
+          }
+
+          for (used = i = 0; i < n; i++) {
+               if (old[i].key) {
+                    *slot(old[i].key) = old[i];
+                    used++;
+               }
+          }
+          free(old);
+     }
+
+     s = slot(r->key);
+     if (!s->key) {
+          used++;
+     }
+     *s = *r;
+}
+
+/* Load cache from FILE, creating it if necessary.
+ *
+ * Return true if the cache could be opened, otherwise print an error
+ * and return false. */
+bool
+cache_open(const char *file)
+{
+     struct Record buf[256];
+     ssize_t n, i;
+     off_t end;
+
+     fd = open(file, O_RDWR | O_CREAT | O_APPEND, 0644);
+     if (fd < 0) {
+          perror(file);
+          return false;
+     }
+
+     while ((n = read(fd, buf, sizeof(buf))) > 0) {
+          for (i = 0; i < n / (ssize_t) sizeof(*buf); i++) {
+               insert(&buf[i]);
+          }
+     }
+     if (n < 0) {
+          perror(file);
+          cache_close();
+          return false;
+     }
+
+     /* drop a partially written record, left over from a crash */
+     end = lseek(fd, 0, SEEK_END);
+     if (end % sizeof(struct Record) &&
+         ftruncate(fd, end - end % sizeof(struct Record)) < 0) {
+          perror(file);
+          cache_close();
+          return false;
+     }
+
+     return true;
+}
+
+/* Look up KEY, and store the cached vertex in the second argument.
+ *
+ * Return true if KEY was found. */
+bool
+cache_lookup(uint64_t key, struct Vertex *v)
+{
+     struct Record *r;
+
+     if (fd < 0 || !cap) {
+          return false;
+     }
+
+     r = slot(fix_key(key));
+     if (!r->key) {
+          return false;
+     }
+
+     v->type = r->type;
+     v->coord = C(r->x, r->y);
+     return true;
+}
+
+/* Remember vertex V for KEY, both in memory and on disk. */
+void
+cache_store(uint64_t key, struct Vertex v)
+{
+     struct Record r = {
+          .key  = fix_key(key),
+          .type = v.type,
+          .x    = v.coord.x,
+          .y    = v.coord.y,
+     };
+
+     if (fd < 0) {
+          return;
+     }
+
+     insert(&r);
+     if (write(fd, &r, sizeof(r)) != sizeof(r)) {
+          perror("cache");
+     }
+}
+
+void
+cache_close(void)
+{
+     if (fd >= 0) {
+          close(fd);
+          fd = -1;
+     }
+     free(table);
+     table = NULL;
+     cap = used = 0;
+}
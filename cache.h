@@ -0,0 +1,30 @@
+/* Copyright 2020-2021 Philip Kaludercic
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "gtp.h"
+
+#ifndef CACHE_H
+#define CACHE_H
+
+bool	cache_open(const char *);
+bool	cache_lookup(uint64_t, struct Vertex *);
+void	cache_store(uint64_t, struct Vertex);
+void	cache_close(void);
+
+#endif
@@ -0,0 +1,194 @@
+/* Game clocks
+ *
+ * Copyright 2020-2021 Philip Kaludercic
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "clock.h"
+
+/* Return a monotonic timestamp in microseconds, e.g. to measure
+ * latencies. */
+uint64_t
+clock_now_us(void)
+{
+     struct timespec ts;
+
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Return a monotonic timestamp in milliseconds. */
+uint64_t
+clock_now(void)
+{
+     return clock_now_us() / 1000;
+}
+
+/* Set up clock C according to the time control SPEC, all given in
+ * seconds:
+ *
+ *   MAIN                absolute time
+ *   MAIN,PERIOD,N       byo-yomi with N periods
+ *   MAIN,PERIOD/N       Canadian overtime, N stones per period
+ *
+ * Return false if SPEC can't be parsed. */
+bool
+clock_parse(struct Clock *c, const char *spec)
+{
+     unsigned main, period = 0, count = 0;
+     char sep = 0, end;
+     int n;
+
+     memset(c, 0, sizeof(*c));
+     n = sscanf(spec, "%u,%u%c%u%c", &main, &period, &sep, &count, &end);
+     switch (n) {
+     case 1:
+          c->overtime = ABSOLUTE;
+          break;
+     case 4:
+          if (sep == ',' && count) {
+               c->overtime = BYO_YOMI;
+               break;
+          } else if (sep == '/' && count) {
+               c->overtime = CANADIAN;
+               break;
+          }
+          /* fallthrough */
+     default:
+          return false;
+     }
+     if (n == 1 && strchr(spec, ',')) {
+          return false;
+     }
+
+     c->main = main * 1000ULL;
+     c->period = period * 1000ULL;
+     c->count = count;
+     c->time[BLACK] = c->time[WHITE] = (struct Time) { .left = c->main };
+     c->running = NONE;
+     return true;
+}
+
+/* Take ELAPSED ms off the time T of clock C.  If MOVED, the player
+ * ended the turn by playing, which restarts a byo-yomi period or
+ * counts a stone of a Canadian period. */
+static void
+charge(const struct Clock *c, struct Time *t, uint64_t elapsed, bool moved)
+{
+     if (t->flagged) {
+          return;
+     }
+
+     if (!t->overtime) {
+          if (elapsed < t->left || (elapsed == t->left && moved)) {
+               t->left -= elapsed;
+               return;
+          }
+          elapsed -= t->left;
+          if (c->overtime == ABSOLUTE) {
+               t->left = 0;
+               t->flagged = true;
+               return;
+          }
+          t->overtime = true;
+          t->left = c->period;
+          t->count = c->count;
+     }
+
+     switch (c->overtime) {
+     case BYO_YOMI:
+          /* every period that runs out completely is lost */
+          while (elapsed >= t->left) {
+               if (t->count <= 1) {
+                    t->left = 0;
+                    t->count = 0;
+                    t->flagged = true;
+                    return;
+               }
+               elapsed -= t->left;
+               t->left = c->period;
+               t->count--;
+          }
+          t->left = moved ? c->period : t->left - elapsed;
+          break;
+     case CANADIAN:
+          if (elapsed >= t->left) {
+               t->left = 0;
+               t->flagged = true;
+               return;
+          }
+          t->left -= elapsed;
+          if (moved && --t->count == 0) {
+               t->left = c->period;
+               t->count = c->count;
+          }
+          break;
+     default:
+          ;
+     }
+}
+
+/* Stop the clock of the player whose turn it was, and start the one
+ * of S instead, or no clock if S is NONE.  Nothing happens if it
+ * already is the turn of S. */
+void
+clock_switch(struct Clock *c, enum Stone s)
+{
+     uint64_t t = clock_now();
+
+     if (s == c->running) {
+          return;
+     }
+     if (c->running != NONE) {
+          charge(c, &c->time[c->running], t - c->since, s != NONE);
+     }
+     c->running = s;
+     c->since = t;
+}
+
+/* Return the time player S has left right now. */
+struct Time
+clock_peek(const struct Clock *c, enum Stone s)
+{
+     struct Time t = c->time[s];
+
+     if (s == c->running) {
+          charge(c, &t, clock_now() - c->since, false);
+     }
+     return t;
+}
+
+/* Describe the time player S has left in BUF of length LEN, e.g.
+ * "9:58" or "0:21 (3x30)". */
+void
+clock_format(const struct Clock *c, enum Stone s, char *buf, size_t len)
+{
+     struct Time t = clock_peek(c, s);
+     uint64_t sec = (t.left + 999) / 1000; /* don't show 0:00 too early */
+
+     if (!t.overtime) {
+          snprintf(buf, len, "%u:%02u", (unsigned) (sec / 60),
+                   (unsigned) (sec % 60));
+     } else {
+          snprintf(buf, len, "%u:%02u (%u%c%u)",
+                   (unsigned) (sec / 60), (unsigned) (sec % 60),
+                   t.count, c->overtime == BYO_YOMI ? 'x' : '/',
+                   (unsigned) (c->period / 1000));
+     }
+}
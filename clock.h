@@ -0,0 +1,57 @@
+/* Copyright 2020-2021 Philip Kaludercic
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "board.h"
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+/* The time a player has left, see clock_peek */
+struct Time {
+     uint64_t	 left;		/* in ms, of the main time or the period */
+     unsigned	 count;		/* periods or stones left in overtime */
+     bool	 overtime;
+     bool	 flagged;	/* the player has run out of time */
+};
+
+/* A game clock for both players, see clock_parse */
+struct Clock {
+     enum {
+	  ABSOLUTE,
+	  BYO_YOMI,		/* COUNT periods of PERIOD ms each */
+	  CANADIAN,		/* COUNT stones every PERIOD ms */
+     } overtime;
+     uint64_t	 main;		/* in ms */
+     uint64_t	 period;	/* in ms */
+     unsigned	 count;
+
+     struct Time time[3];	/* indexed by enum Stone */
+     enum Stone	 running;	/* NONE if the clock is stopped */
+     uint64_t	 since;		/* see clock_now, when RUNNING was started */
+};
+
+uint64_t    clock_now(void);
+uint64_t    clock_now_us(void);
+bool	    clock_parse(struct Clock *, const char *);
+void	    clock_switch(struct Clock *, enum Stone);
+struct Time clock_peek(const struct Clock *, enum Stone);
+void	    clock_format(const struct Clock *, enum Stone, char *, size_t);
+
+#endif
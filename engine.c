@@ -0,0 +1,474 @@
+/* Engine process management
+ *
+ * Copyright 2020-2021 Philip Kaludercic
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "clock.h"
+#include "engine.h"
+
+extern bool verbose;
+
+/* ms a stopped engine is given to exit on its own before it is
+ * killed, and between checks whether it has */
+#define EXIT_TIMEOUT 500
+#define EXIT_TICK 10
+
+/* Engines that have been stopped, but haven't been collected yet,
+ * see engine_reap */
+static struct Exiting {
+     pid_t pid;
+     uint64_t kill_at;
+} *exiting;
+static size_t nexiting, exiting_cap;
+
+/* Split the command line CMD into a NULL-terminated argument vector.
+ * Arguments are separated by whitespace, unless quoted with single
+ * or double quotes, or escaped using a backslash.
+ *
+ * Return NULL if the command is empty or a quote isn't closed. */
+char **
+engine_parse(const char *cmd)
+{
+     char **argv, *arg, quote = 0;
+     size_t argc = 0, len = 0;
+     const char *c;
+
+     /* there can't be more arguments than characters */
+     argv = calloc(strlen(cmd) + 1, sizeof(char *));
+     arg = malloc(strlen(cmd) + 1);
+     if (!argv || !arg) {
+          perror("malloc");
+          exit(EXIT_FAILURE);
+     }
+
+     for (c = cmd; ; c++) {
+          if (!quote && (*c == '\0' || *c == ' ' || *c == '\t')) {
+               if (len) {
+                    arg[len] = '\0';
+                    argv[argc++] = strdup(arg);
+                    len = 0;
+               }
+               if (*c == '\0') {
+                    break;
+               }
+          } else if (*c == '\0') {
+               goto fail;       /* unterminated quote */
+          } else if (*c == quote) {
+               quote = 0;
+          } else if (!quote && (*c == '"' || *c == '\'')) {
+               quote = *c;
+               /* "" is an empty argument */
+               if (c[1] == quote) {
+                    argv[argc++] = strdup("");
+               }
+          } else if (*c == '\\' && quote != '\'' && c[1]) {
+               arg[len++] = *++c;
+          } else {
+               arg[len++] = *c;
+          }
+     }
+
+     free(arg);
+     if (argc == 0) {
+          free(argv);
+          return NULL;
+     }
+     return argv;
+
+fail:
+     free(arg);
+     while (argc) {
+          free(argv[--argc]);
+     }
+     free(argv);
+     return NULL;
+}
+
+static void
+nonblocking(int fd)
+{
+     int flags = fcntl(fd, F_GETFL);
+
+     /* engines started later must not inherit the pipe, or closing
+      * it wouldn't make the engine exit */
+     if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+         fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+          perror("fcntl");
+          exit(EXIT_FAILURE);
+     }
+}
+
+/* Close both ends of the pipe P, as far as they have been opened. */
+static void
+close_pipe(int p[2])
+{
+     if (p[0] >= 0) {
+          close(p[0]);
+     }
+     if (p[1] >= 0) {
+          close(p[1]);
+     }
+}
+
+/* Use the file descriptors IN and OUT to talk to engine E, e.g. the
+ * standard input and output of sgo. */
+void
+engine_fds(struct Engine *e, int in, int out)
+{
+     nonblocking(in);
+     nonblocking(out);
+     e->argv = NULL;
+     e->pid = 0;
+     e->in = in;
+     e->out = out;
+     e->err = -1;
+}
+
+/* Look up the TCP address HOST:PORT in ADDRESS, the host name
+ * possibly in brackets, to connect to or to listen on if PASSIVE.
+ * Return NULL if it can't be resolved. */
+static struct addrinfo *
+resolve(const char *address, bool passive)
+{
+     struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *res;
+     char host[256];
+     const char *port;
+     size_t len;
+     int err;
+
+     port = strrchr(address, ':');
+     if (!port) {
+          fprintf(stderr, "%s: missing port\n", address);
+          return NULL;
+     }
+     len = port++ - address;
+     if (len >= 2 && address[0] == '[' && address[len - 1] == ']') {
+          address++;
+          len -= 2;
+     }
+     if (len >= sizeof(host)) {
+          fprintf(stderr, "%s: host name too long\n", address);
+          return NULL;
+     }
+     memcpy(host, address, len);
+     host[len] = '\0';
+
+     if (passive) {
+          hints.ai_flags = AI_PASSIVE;
+     }
+     if ((err = getaddrinfo(len ? host : NULL, port, &hints, &res))) {
+          fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+          return NULL;
+     }
+     return res;
+}
+
+/* Create a non-blocking socket for ADDRESS, either "unix:PATH" or
+ * "tcp:HOST:PORT", and pass it to OP (connect or bind) with each of
+ * the socket addresses ADDRESS stands for, until one succeeds.
+ *
+ * Return the socket, or -1. */
+static int
+open_socket(const char *address, bool passive,
+            int (*op)(int, const struct sockaddr *, socklen_t))
+{
+     struct sockaddr_un sun = { .sun_family = AF_UNIX };
+     struct addrinfo *res, *ai;
+     int fd = -1, one = 1;
+
+     if (!strncmp(address, "unix:", 5)) {
+          address += strlen("unix:");
+          if (strlen(address) >= sizeof(sun.sun_path)) {
+               fprintf(stderr, "%s: path too long\n", address);
+               return -1;
+          }
+          strcpy(sun.sun_path, address);
+
+          fd = socket(AF_UNIX, SOCK_STREAM, 0);
+          if (fd < 0) {
+               perror("socket");
+               return -1;
+          }
+          nonblocking(fd);
+          if (op(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0 &&
+              errno != EINPROGRESS) {
+               perror(address);
+               close(fd);
+               return -1;
+          }
+          return fd;
+     }
+
+     if (!(res = resolve(address + strlen("tcp:"), passive))) {
+          return -1;
+     }
+     for (ai = res; ai; ai = ai->ai_next) {
+          fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+          if (fd < 0) {
+               continue;
+          }
+          nonblocking(fd);
+          /* commands are small, and should be sent immediately */
+          setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+          if (passive) {
+               setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+          }
+          if (!op(fd, ai->ai_addr, ai->ai_addrlen) || errno == EINPROGRESS) {
+               break;
+          }
+          perror(address);
+          close(fd);
+          fd = -1;
+     }
+     freeaddrinfo(res);
+
+     return fd;
+}
+
+/* Check if ADDRESS is the address of an engine service, rather than
+ * a command line. */
+bool
+engine_address(const char *address)
+{
+     return !strncmp(address, "unix:", 5) || !strncmp(address, "tcp:", 4);
+}
+
+/* Listen for connections on ADDRESS (see engine_address).  A stale
+ * Unix domain socket is replaced.
+ *
+ * Return the listening socket, or -1. */
+int
+engine_listen(const char *address)
+{
+     int fd;
+
+     if (!strncmp(address, "unix:", 5)) {
+          unlink(address + 5);
+     }
+     fd = open_socket(address, true, bind);
+     if (fd >= 0 && listen(fd, SOMAXCONN) < 0) {
+          perror("listen");
+          close(fd);
+          return -1;
+     }
+     return fd;
+}
+
+/* Start engine E, connecting its standard streams to new pipes.  If
+ * the command is an address of the form "unix:PATH" or
+ * "tcp:HOST:PORT", the engine is expected to be running already, and
+ * a connection is opened instead.  The connection is established in
+ * the background, so that a failure only shows once it is used.
+ *
+ * Return false if the engine couldn't be started. */
+bool
+engine_spawn(struct Engine *e)
+{
+     int in[2] = { -1, -1 }, out[2] = { -1, -1 }, err[2] = { -1, -1 }, fd;
+
+     assert(e->argv);
+
+     /* a dead engine shouldn't kill sgo when written to */
+     signal(SIGPIPE, SIG_IGN);
+
+     if (engine_address(e->argv[0])) {
+          if ((fd = open_socket(e->argv[0], false, connect)) < 0) {
+               return false;
+          }
+          e->in = fd;
+          e->out = dup(fd);     /* both are closed by engine_stop */
+          if (e->out < 0) {
+               perror("dup");
+               close(fd);
+               e->in = -1;
+               return false;
+          }
+          e->err = -1;
+          if (verbose) {
+               fprintf(stderr, "connecting to %s\n", e->argv[0]);
+          }
+          return true;
+     }
+
+     /* engines are restarted until they work, so nothing that was
+      * opened may be left behind if starting one fails */
+     if (pipe(in) < 0 || pipe(out) < 0 || pipe(err) < 0) {
+          perror("pipe");
+          goto fail;
+     }
+
+     e->pid = fork();
+     switch (e->pid) {
+     case -1:
+          perror("fork");
+          e->pid = 0;
+          goto fail;
+     case 0:                    /* child */
+          dup2(out[0], STDIN_FILENO);
+          dup2(in[1], STDOUT_FILENO);
+          dup2(err[1], STDERR_FILENO);
+          close(in[0]); close(in[1]);
+          close(out[0]); close(out[1]);
+          close(err[0]); close(err[1]);
+          signal(SIGPIPE, SIG_DFL);
+          execvp(e->argv[0], e->argv);
+          fprintf(stderr, "%s: %s\n", e->argv[0], strerror(errno));
+          _exit(127);
+     }
+
+     close(in[1]);
+     close(out[0]);
+     close(err[1]);
+     e->in = in[0];
+     e->out = out[1];
+     e->err = err[0];
+     nonblocking(e->in);
+     nonblocking(e->out);
+     nonblocking(e->err);
+
+     if (verbose) {
+          fprintf(stderr, "started %s (pid %d)\n", e->argv[0], (int) e->pid);
+     }
+
+     return true;
+
+fail:
+     close_pipe(in);
+     close_pipe(out);
+     close_pipe(err);
+     return false;
+}
+
+/* Handle output of engine E on standard error.  In verbose mode it
+ * is passed on line by line, otherwise it is discarded. */
+void
+engine_stderr(struct Engine *e)
+{
+     char buf[BUFSIZ], *line, *nl;
+     ssize_t n;
+
+     while ((n = read(e->err, buf, sizeof(buf) - 1)) > 0) {
+          if (!verbose) {
+               continue;
+          }
+
+          buf[n] = '\0';
+          for (line = buf; *line; line = nl + 1) {
+               nl = strchr(line, '\n');
+               if (!nl) {
+                    fprintf(stderr, "[%s] %s\n", e->argv[0], line);
+                    break;
+               }
+               *nl = '\0';
+               fprintf(stderr, "[%s] %s\n", e->argv[0], line);
+          }
+     }
+
+     if (n == 0) {              /* engine closed stderr */
+          close(e->err);
+          e->err = -1;
+     }
+}
+
+/* Terminate engine E, or close the connection to it.  Closing its
+ * standard input should make any engine exit, but it isn't waited
+ * for, so that other engines aren't held up.  It is collected, or
+ * killed if it doesn't exit in time, by engine_reap. */
+void
+engine_stop(struct Engine *e)
+{
+     struct Exiting *x;
+
+     if (e->in < 0) {
+          return;
+     }
+
+     close(e->out);
+     close(e->in);
+     if (e->err >= 0) {
+          close(e->err);
+     }
+     e->in = e->out = e->err = -1;
+     if (e->pid <= 0) {
+          return;
+     }
+
+     if (nexiting == exiting_cap) {
+          exiting_cap = exiting_cap ? exiting_cap * 2 : 8;
+          x = realloc(exiting, exiting_cap * sizeof(*x));
+          if (!x) {
+               perror("realloc");
+               exit(EXIT_FAILURE);
+          }
+          exiting = x;
+     }
+     exiting[nexiting].pid = e->pid;
+     exiting[nexiting].kill_at = clock_now() + EXIT_TIMEOUT;
+     nexiting++;
+     e->pid = 0;
+}
+
+/* Collect the stopped engines that have exited, and kill those that
+ * are still running when their time is up.  Return the number of ms
+ * until this should be done again, or -1 if no engine is left. */
+int
+engine_reap(void)
+{
+     uint64_t t = clock_now();
+     size_t i = 0;
+
+     while (i < nexiting) {
+          if (waitpid(exiting[i].pid, NULL, WNOHANG) != 0) {
+               exiting[i] = exiting[--nexiting];
+               continue;
+          }
+          if (t >= exiting[i].kill_at) {
+               kill(exiting[i].pid, SIGKILL);
+               exiting[i].kill_at = UINT64_MAX;
+          }
+          i++;
+     }
+     return nexiting ? EXIT_TICK : -1;
+}
+
+/* Wait until all stopped engines have been collected, e.g. before
+ * sgo exits. */
+void
+engine_wait(void)
+{
+     struct timespec tick = { .tv_nsec = EXIT_TICK * 1000 * 1000 };
+
+     while (engine_reap() >= 0) {
+          nanosleep(&tick, NULL);
+     }
+}
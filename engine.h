@@ -0,0 +1,44 @@
+/* Copyright 2020-2021 Philip Kaludercic
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+/* An engine running as a child process of sgo, or as a service sgo
+ * connects to (see engine_spawn), or on the other end of a pair of
+ * file descriptors (see engine_fds) */
+struct Engine {
+     char	**argv;         /* NULL for a pair of file descriptors */
+     pid_t	  pid;          /* 0 unless running as a child process */
+     int	  in;           /* engine's standard output, read by sgo */
+     int	  out;          /* engine's standard input, written by sgo */
+     int	  err;          /* engine's standard error, or -1 */
+};
+
+char	**engine_parse(const char *);
+bool	  engine_spawn(struct Engine *);
+void	  engine_fds(struct Engine *, int, int);
+bool	  engine_address(const char *);
+int	  engine_listen(const char *);
+void	  engine_stderr(struct Engine *);
+void	  engine_stop(struct Engine *);
+int	  engine_reap(void);
+void	  engine_wait(void);
+
+#endif
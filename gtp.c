@@ -19,16 +19,27 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
-#include <fcntl.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <poll.h>
+#include <sys/uio.h>
+
 #include "board.h"
+#include "cache.h"
+#include "clock.h"
+#include "engine.h"
 #include "gtp.h"
+#include "latency.h"
+#include "uring.h"
+
+#define LENGTH(a) (sizeof(a)/sizeof(*a))
 
 /* The Go Text Protocol specification can be found here:
  *
@@ -37,22 +48,415 @@
 
 extern bool verbose;
 extern bool debug;
-
-static struct Query {
-     uint32_t id;
+extern char *komi;
+
+/* Commands that have been sent to an engine, but haven't been
+ * answered yet, are kept in a ring indexed by their ID.  As IDs are
+ * handed out in increasing order, a response can be matched to its
+ * query in constant time, as long as no more than QUERIES commands
+ * are in flight at once, and no memory has to be allocated per
+ * command. */
+#define QUERIES 1024
+
+/* Times the size of a hash table of names is doubled, before giving
+ * up on finding one, see names_build */
+#define NAMES_RETRIES 4
+
+/* A set of names in a perfect hash table, see names_build */
+struct Names {
+     const char *const *name;
+     uint16_t *slot;            /* index into NAME plus one, 0 if empty */
+     uint16_t *seed;            /* per bucket */
+     uint32_t slots, buckets;   /* SLOTS is a power of two */
+};
+
+struct Query {
+     uint32_t id;               /* 0 if the slot is unused */
      enum Command cmd;
+     enum Form form;            /* of the response */
      callback cb;
-     struct Board *b;
-     struct Query *next;
-} *queries = NULL;
+     bool cached;               /* store response in cache */
+     uint64_t key;              /* cache key */
+     uint8_t transform;         /* see board_key */
+     char player;               /* 'b' or 'w' for move requests */
 
-static struct Response {
-     uint32_t id;
+     bool done;                 /* response has been received */
      bool error;
-     char *resp;
-     ssize_t len;
-     struct Response *next;
-} *responses = NULL;
+     char *resp;                /* usually a slice of the input buffer */
+     size_t len;
+     char answer[16];           /* for responses generated locally */
+
+     char *line;                /* command to send, empty if none */
+     size_t line_len, line_cap;
+     char *param;               /* parameters within LINE, or NULL */
+     uint64_t deadline;         /* see clock_now(), 0 if none */
+     bool bounded;              /* fail instead of retrying after DEADLINE */
+     bool cancelled;            /* see gtp_cancel */
+     unsigned retries;          /* times asked again after a restart */
+     bool speculative;          /* see gtp_ponder */
+     bool ahead;                /* the move has a placeholder in the path */
+     bool streaming;            /* response is a stream of lines */
+     bool opened;               /* the first line of the stream was read */
+
+     /* see clock_now_us, 0 if it hasn't happened yet */
+     uint64_t queued, written, answered;
+};
+
+/* Every engine sgo talks to has a connection of its own, with
+ * separate IDs, buffers and queues, so that a slow engine never
+ * holds up any other. */
+struct Gtp {
+     struct Board *board;       /* position the engine is kept up to date with */
+     char *name;                /* name of the engine, used to distinguish cache entries */
+
+     struct Query queries[QUERIES];
+     uint32_t counter;          /* last ID handed out */
+     uint32_t expected;         /* oldest ID without a response */
+
+     /* Commands are not written out immediately, but queued up in
+      * their query slots, until flush writes all of them at once.
+      * At most WINDOW commands may be in flight, so that writing
+      * never blocks because the engine hasn't read the previous
+      * commands. */
+     uint32_t sent;             /* last ID completely written */
+     size_t partial;            /* bytes of the next command written */
+     bool blocked;              /* the last write would have blocked */
+
+     /* IDs of queries that have been answered, but whose callbacks
+      * haven't been invoked yet, in the order they were answered */
+     uint32_t ready[QUERIES];
+     uint32_t ready_head, ready_tail;
+
+     /* The engine is either connected to sgo's standard input and
+      * output, or runs as a child process, which is restarted if it
+      * crashes or stops responding. */
+     int in, out;
+     struct Engine child;
+     struct Reader input;
+     bool busy;                 /* see check_responses */
+     bool alive;                /* the engine has responded since starting */
+     unsigned failures;         /* restarts without any response */
+     unsigned generation;       /* incremented by every restart */
+     bool dead;                 /* given up on, see disconnect */
+     size_t nfds;               /* entries added by gtp_fds */
+
+     /* With io_uring (see gtp_uring), a read from the engine is
+      * always pending.  What it returns is held until
+      * check_responses takes it, and commands are written by a
+      * single write in flight. */
+     unsigned serial;           /* tells requests of engines apart */
+     char *held;
+     size_t held_len, held_cap;
+     int held_err;              /* errno of a failed read, -1 at end of file */
+     bool writing;
+     struct iovec *iov;         /* of the write in flight */
+
+     /* Analysis updates are parsed into the back buffer, which then
+      * replaces the front buffer, so that readers never see half an
+      * update. */
+     enum Command analyze;      /* command to analyse with, or 0 */
+     unsigned interval;         /* centiseconds between updates */
+     struct Analysis analysis[2];
+     unsigned front;
+
+     char time_settings[32];    /* see gtp_time_settings, empty if none */
+
+     /* Commands the engine reported by list_commands, see
+      * gtp_supports.  Commands sgo knows but the engine doesn't
+      * support fail without being sent. */
+     struct Names supported;    /* no slots until the list is known */
+     char *listing;             /* the names in SUPPORTED point into it */
+     uint32_t lacking;          /* bit for every enum Command not supported */
+
+     /* Moves the engine has been told about since its board was last
+      * cleared, so that it can be brought to another position with
+      * few commands, see resync. */
+     struct Step {
+          enum Stone player;
+          struct Coord placed;
+          bool pass;
+     } *path;
+     size_t depth, path_cap;
+     bool no_undo;              /* the engine failed to undo a move */
+     bool lost;                 /* the engine rejected a move */
+
+     /* The engine may think about its reply to a move it expects
+      * ahead of time, see gtp_ponder. */
+     struct {
+          enum Stone player;    /* of the expected move, NONE if not pondering */
+          struct Coord guess;
+          bool hit;             /* the expected move was played */
+          uint32_t id;          /* of the speculative genmove */
+          size_t at;            /* of its placeholder in the path */
+          bool answered;
+          struct Vertex reply;
+     } ponder;
+
+     struct Gtp *next;
+};
+
+#define slot(g, id) (&(g)->queries[(id) % QUERIES])
+
+/* io_uring requests of G, see completed.  Requests made before a
+ * restart carry an older generation, and are ignored. */
+enum Request { INPUT, OUTPUT, READABLE, WRITABLE };
+#define request(g, r) ((uint64_t) (g)->serial << 34 | \
+                       (uint64_t) ((g)->generation & 0xffffffff) << 2 | (r))
+
+/* commands written at once, IOV_MAX on most systems */
+#define IOVS 1024
+
+#define MAX_FAILURES 3
+
+/* ms to wait for the answer to a cancelled command, before the engine
+ * is restarted to stop it */
+#define CANCEL_GRACE 2000
+
+static struct Gtp *connections;
+static unsigned batching;       /* nesting depth of gtp_batch_begin */
+static bool speculating;        /* see gtp_ponder */
+static enum Form raw_form;      /* see gtp_run_raw */
+static unsigned window = QUERIES;
+static bool uring;              /* see gtp_uring */
+static struct Gtp *waiting;     /* see gtp_run_command */
+
+/* seconds to wait for the first and for any other response */
+static unsigned startup_timeout = 10, response_timeout, move_timeout;
+
+static void resync(struct Gtp *);
+static void finish(struct Gtp *, struct Query *, bool);
+
+static const char *const commands[] = {
+     [PROTOCOL_VERSION]	= "protocol_version",
+     [NAME]		= "name",
+     [KNOWN_COMMAND]	= "known_command",
+     [LIST_COMMANDS]	= "list_commands",
+     [QUIT]		= "quit",
+     [BOARDSIZE]	= "boardsize",
+     [CLEAR_BOARD]	= "clear_board",
+     [KOMI]		= "komi",
+     [PLAY]		= "play",
+     [GENMOVE]		= "genmove",
+     [UNDO]		= "undo",
+     [REG_GENMOVE]	= "reg_genmove",
+     [LZ_ANALYZE]	= "lz-analyze",
+     [KATA_ANALYZE]	= "kata-analyze",
+     [TIME_SETTINGS]	= "time_settings",
+     [TIME_LEFT]	= "time_left",
+     [VERSION]		= "version",
+     [FINAL_SCORE]	= "final_score",
+     [RAW]		= NULL,  /* the name is part of the parameters */
+};
+
+/* Form of the response to every command, see gtp_run_raw for RAW */
+static const enum Form forms[] = {
+     [PROTOCOL_VERSION]	= INT,
+     [NAME]		= STRING,
+     [KNOWN_COMMAND]	= BOOL,
+     [LIST_COMMANDS]	= STRING,
+     [QUIT]		= NIHIL,
+     [BOARDSIZE]	= NIHIL,
+     [CLEAR_BOARD]	= NIHIL,
+     [KOMI]		= NIHIL,
+     [PLAY]		= NIHIL,
+     [GENMOVE]		= VERTEX,
+     [UNDO]		= NIHIL,
+     [REG_GENMOVE]	= VERTEX,
+     [LZ_ANALYZE]	= NIHIL,
+     [KATA_ANALYZE]	= NIHIL,
+     [TIME_SETTINGS]	= NIHIL,
+     [TIME_LEFT]	= NIHIL,
+     [VERSION]		= STRING,
+     [FINAL_SCORE]	= STRING,
+     [RAW]		= STRING,
+};
+
+/* Raw commands sent to every engine after it started, see
+ * gtp_setup */
+static const char **setup;
+static size_t nsetup;
+
+/* Hash the string S with SEED (FNV-1a). */
+static uint32_t
+hash(const char *s, uint32_t seed)
+{
+     uint32_t h = 2166136261u ^ seed;
+
+     for (; *s; s++) {
+          h ^= (unsigned char) *s;
+          h *= 16777619u;
+     }
+     return h ^ (h >> 15);
+}
+
+/* Look up NAME in T, and return its index, or -1 if it isn't in
+ * T. */
+static int
+names_find(const struct Names *t, const char *name)
+{
+     uint32_t b, i;
+
+     if (!t->slots) {
+          return -1;
+     }
+     b = hash(name, 0) % t->buckets;
+     i = t->slot[hash(name, t->seed[b] + 1) & (t->slots - 1)];
+     return i && !strcmp(t->name[i - 1], name) ? (int) i - 1 : -1;
+}
+
+/* Release the table T. */
+static void
+names_free(struct Names *t)
+{
+     free(t->slot);
+     free(t->seed);
+     memset(t, 0, sizeof(*t));
+}
+
+/* Store the N names NAME (skipping NULL entries and repeated names)
+ * in the perfect hash table T, that refers to NAME from then on.
+ * Return false, leaving T empty, if no table could be found.
+ *
+ * The names are divided into buckets by one hash, and every bucket
+ * gets a seed of its own for a second hash, that places all of the
+ * names in the bucket into slots that are still empty.  The seeds are
+ * found by trying one after another, starting with the largest
+ * buckets.  Looking a name up then takes two hashes and one
+ * comparison. */
+static bool
+names_build(struct Names *t, const char *const *name, size_t n)
+{
+     uint16_t *order, *count, *taken, k;
+     uint32_t i, j, b, d, slots = 8, retries = NAMES_RETRIES;
+     bool failed;
+
+     names_free(t);
+     if (n >= UINT16_MAX) {
+          return false;
+     }
+     while (slots < 2 * n) {
+          slots *= 2;
+     }
+retry:
+     names_free(t);
+     t->name = name;
+     t->slots = slots;
+     t->buckets = n / 2 + 1;
+     t->slot = calloc(slots, sizeof(uint16_t));
+     t->seed = calloc(t->buckets, sizeof(uint16_t));
+     order = calloc(t->buckets, sizeof(uint16_t));
+     count = calloc(t->buckets, sizeof(uint16_t));
+     taken = calloc(n + 1, sizeof(uint16_t));
+     if (!t->slot || !t->seed || !order || !count || !taken) {
+          perror("calloc");
+          exit(EXIT_FAILURE);
+     }
+
+     /* largest buckets first, while there is much room left */
+     for (i = 0; i < n; i++) {
+          if (name[i]) {
+               count[hash(name[i], 0) % t->buckets]++;
+          }
+     }
+     for (b = 0; b < t->buckets; b++) {
+          for (j = b; j > 0 && count[order[j - 1]] < count[b]; j--) {
+               order[j] = order[j - 1];
+          }
+          order[j] = b;
+     }
+
+     for (j = 0; j < t->buckets && count[order[j]]; j++) {
+          b = order[j];
+          for (d = 0; d <= UINT16_MAX; d++) {
+               for (i = 0, k = 0; i < n; i++) {
+                    uint32_t at;
+
+                    if (!name[i] || hash(name[i], 0) % t->buckets != b) {
+                         continue;
+                    }
+                    at = hash(name[i], d + 1) & (slots - 1);
+                    if (t->slot[at] && !strcmp(name[t->slot[at] - 1], name[i])) {
+                         continue; /* the same name always meets itself */
+                    }
+                    if (t->slot[at]) {
+                         break;
+                    }
+                    t->slot[at] = i + 1;
+                    taken[k++] = at;
+               }
+               if (i == n) {
+                    t->seed[b] = d;
+                    break;
+               }
+               while (k > 0) {  /* collision, try the next seed */
+                    t->slot[taken[--k]] = 0;
+               }
+          }
+          if (d > UINT16_MAX) {
+               break;
+          }
+     }
+
+     failed = j < t->buckets && count[order[j]];
+     free(order);
+     free(taken);
+     free(count);
+     if (failed && retries--) {
+          slots *= 2;
+          goto retry;
+     }
+     if (failed) {
+          names_free(t);
+          return false;
+     }
+     return true;
+}
+
+/* Return the name of command C. */
+const char *
+gtp_command_name(enum Command c)
+{
+     assert(c < LENGTH(commands) && commands[c]);
+     return commands[c];
+}
+
+/* Look up the command called NAME, and store it in C.  Return false
+ * if there is no such command. */
+bool
+gtp_command(const char *name, enum Command *c)
+{
+     static struct Names known;
+     int i;
+
+     if (!known.slots) {
+          names_build(&known, commands, LENGTH(commands));
+     }
+     i = names_find(&known, name);
+     if (i < 0) {
+          return false;
+     }
+     *c = i;
+     return true;
+}
+
+/* The time every command takes is split up into the time it waits
+ * to be written, the time until the engine responds, and the time
+ * sgo spends parsing the response and running the callback. */
+enum Stage { WAIT, ENGINE, PARSE, CALLBACK, STAGES };
+
+static const char *const stages[] = {
+     [WAIT] = "wait", [ENGINE] = "engine",
+     [PARSE] = "parse", [CALLBACK] = "callback",
+};
+
+static struct Latency latency[LENGTH(commands)][STAGES];
+static volatile sig_atomic_t report; /* see gtp_latency_on */
+static bool report_json;
+
+static void flush(struct Gtp *);
+static void reanalyze(struct Gtp *);
+static void check_responses(struct Gtp *);
+static void restart(struct Gtp *, const char *);
 
 __attribute__ ((noreturn))
 static void
@@ -86,11 +490,14 @@ gtp_log(char *fmt, ...)
      fputs("\n", stderr);
 }
 
-
+
 
 static bool
-gtp_ensure_version(struct Obj *o, bool error)
+gtp_ensure_version(struct Gtp *g, struct Obj *o, bool error)
 {
+     if (error && g->dead) {
+          return false;         /* see disconnect */
+     }
      assert(!error);
      assert(o->form == INT);
      if (o->val.v_int != 2)
@@ -100,10 +507,13 @@ gtp_ensure_version(struct Obj *o, bool error)
 }
 
 static bool
-gtp_check_name(struct Obj *o, bool error)
+gtp_check_name(struct Gtp *g, struct Obj *o, bool error)
 {
      char *c;
 
+     if (error && g->dead) {
+          return false;         /* see disconnect */
+     }
      assert(!error);
      assert(o->form == STRING);
 
@@ -112,499 +522,2446 @@ gtp_check_name(struct Obj *o, bool error)
           *c = '\0';
      }
 
-     fprintf(stderr, "connected to \"%s\"\n", o->val.v_str);
+     if (verbose) {
+          fprintf(stderr, "connected to \"%s\"\n", o->val.v_str);
+     }
+
+     free(g->name);
+     g->name = strdup(o->val.v_str);
 
      return false;
 }
 
-/* prepare everything required for GTP communication. */
-void
-gtp_init(struct Board *b)
+/* Store the commands engine G supports, as listed in O, and adjust
+ * to those it lacks. */
+static bool
+gtp_list_commands(struct Gtp *g, struct Obj *o, bool error)
 {
-     assert(b->width >= 2 && b->width <= 25);
-     assert(b->height >= 2 && b->height <= 25);
+     const char **name;
+     char *line, *save;
+     size_t n = 0, i;
+
+     if (error) {
+          if (!g->dead && verbose) {
+               fprintf(stderr, "%s doesn't list its commands\n",
+                       g->name ? g->name : "engine");
+          }
+          return false;
+     }
 
-     /* enable asyncrhonous I/O on stdin */
-     int status;
-     if ((status = fcntl(STDIN_FILENO, F_GETFL)) < 0) {
-          perror("fcntl");
+     free(g->listing);
+     g->listing = strdup(o->val.v_str);
+     name = malloc((strlen(o->val.v_str) / 2 + 1) * sizeof(char *));
+     if (!g->listing || !name) {
+          perror("malloc");
           exit(EXIT_FAILURE);
      }
-     if (fcntl(STDIN_FILENO , F_SETFL, status | O_NONBLOCK) < 0) {
-          perror("fcntl");
-          exit(EXIT_FAILURE);
+     for (line = strtok_r(g->listing, " \t\r\n", &save); line;
+          line = strtok_r(NULL, " \t\r\n", &save)) {
+          name[n++] = line;
+     }
+     free((void *) g->supported.name);
+     g->lacking = 0;
+     if (!names_build(&g->supported, name, n)) {
+          free(name);           /* assume everything is supported */
+          if (verbose) {
+               fprintf(stderr, "%s lists too many commands\n",
+                       g->name ? g->name : "engine");
+          }
+          return false;
      }
 
-     /* ensure square board */
-     if (b->width != b->height) {
-          gtp_error("playing against a bot requiers a square board");
+     for (i = 0; i < LENGTH(commands); i++) {
+          if (commands[i] && names_find(&g->supported, commands[i]) < 0) {
+               g->lacking |= 1u << i;
+          }
+     }
+     if (verbose) {
+          fprintf(stderr, "%s supports %zu commands\n",
+                  g->name ? g->name : "engine", n);
+     }
+
+     /* don't find out by trying */
+     if (g->lacking & 1u << UNDO) {
+          g->no_undo = true;
+     }
+     if (g->analyze && g->lacking & 1u << g->analyze) {
+          gtp_analyze(g, g->analyze, g->interval);
+     }
+     return false;
+}
+
+/* Report the failure of a command given by gtp_setup. */
+static bool
+gtp_check_setup(struct Gtp *g, struct Obj *o, bool error)
+{
+     if (error && !g->dead) {
+          fprintf(stderr, "%s: setup failed: %.*s\n",
+                  g->name ? g->name : "engine",
+                  (int) strcspn(o->val.v_str, "\n"), o->val.v_str);
+     }
+     return false;
+}
+
+/* Set the number of seconds to wait for an engine to start up, to
+ * answer any command, and to generate a move.  A timeout of 0 waits
+ * forever.  Unlike other commands, a move request that times out is
+ * not asked again, but fails. */
+void
+gtp_timeouts(unsigned startup, unsigned response, unsigned move)
+{
+     startup_timeout = startup;
+     response_timeout = response;
+     move_timeout = move;
+}
+
+/* Cancel the io_uring requests on the descriptors of G before they
+ * are closed, and drop whatever input hasn't been taken yet. */
+static void
+withdraw(struct Gtp *g)
+{
+     if (uring && g->child.in >= 0) {
+          uring_cancel(g->child.in);
+          if (g->child.out != g->child.in) {
+               uring_cancel(g->child.out);
+          }
+     }
+     g->writing = false;
+     g->held_len = 0;
+     g->held_err = 0;
+}
+
+/* Start the engine of connection G if necessary, and prepare it for
+ * playing on its board.  Return false if the engine can't be
+ * started. */
+static bool
+gtp_init(struct Gtp *g)
+{
+     struct Board *b = g->board;
+     char param[4];
+     size_t i;
+
+     if (g->child.argv && g->child.in < 0) {
+          if (!engine_spawn(&g->child)) {
+               return false;
+          }
+          g->alive = false;
+     }
+     g->in = g->child.in;
+     g->out = g->child.out;
+     if (uring) {
+          if (!g->iov) {
+               g->iov = calloc(IOVS, sizeof(struct iovec));
+               if (!g->iov) {
+                    perror("calloc");
+                    exit(EXIT_FAILURE);
+               }
+          }
+          uring_read(g->in, request(g, INPUT));
      }
 
      /* ensure correct protocl version */
-     gtp_run_command(b, PROTOCOL_VERSION, NULL,
+     gtp_batch_begin();
+     gtp_run_command(g, PROTOCOL_VERSION, NULL,
                      gtp_ensure_version);
 
      /* adjust board size */
-     char param[4];
      assert(b->width < 25);
      sprintf(param, "%d", b->width);
-     gtp_run_command(b, BOARDSIZE, param, NULL);
+     gtp_run_command(g, BOARDSIZE, param, NULL);
 
-     if (verbose) {
-          gtp_run_command(b, NAME, NULL, gtp_check_name);
+     if (komi) {
+          gtp_run_command(g, KOMI, komi, NULL);
+     }
+     if (g->time_settings[0]) {
+          gtp_run_command(g, TIME_SETTINGS, g->time_settings, NULL);
      }
-}
 
-
+     gtp_run_command(g, NAME, NULL, gtp_check_name);
+     if (!g->listing) {
+          gtp_run_command(g, LIST_COMMANDS, NULL, gtp_list_commands);
+     }
+     for (i = 0; i < nsetup; i++) {
+          char line[strlen(setup[i]) + 1];
+
+          gtp_run_raw(g, strcpy(line, setup[i]), STRING, gtp_check_setup);
+     }
+     gtp_batch_end();
+     return true;
+}
 
+/* Tell engine G to play with MAIN seconds of main time, followed by
+ * periods of PERIOD seconds, in which STONES moves have to be
+ * played.  The settings are sent again if the engine is
+ * restarted. */
 void
-gtp_pass(struct Board *b, enum Stone s)
+gtp_time_settings(struct Gtp *g, unsigned main, unsigned period,
+                  unsigned stones)
 {
-     assert(b != NULL);
-     assert(s == BLACK || s == WHITE);
-
-     pass(b, s);
-     gtp_run_command(b, PLAY,
-                     s == BLACK
-                     ? "b pass"
-                     : "w pass",
-                     NULL);
-
+     snprintf(g->time_settings, sizeof(g->time_settings), "%u %u %u",
+              main, period, stones);
+     gtp_run_command(g, TIME_SETTINGS, g->time_settings, NULL);
 }
 
-/* place a STONE at COORD on BOARD and tell the engine */
-bool
-gtp_place_stone(struct Board *b, enum Stone s, struct Coord c)
+/* Connect to an engine playing on BOARD.  The engine is started
+ * using the command line CMD, or reached at the address CMD (see
+ * engine_spawn), or if CMD is NULL, expected to be connected to
+ * standard input and output.
+ *
+ * Return NULL if CMD can't be parsed. */
+struct Gtp *
+gtp_open(struct Board *b, const char *cmd)
 {
-     char param[1 + 1 + 1 + 4 + 1]; /* eg. "b a15" */
+     static unsigned serials;
+     struct Gtp *g, **end;
+     size_t n = 0;
 
-     assert(b != NULL);
-     assert(s == BLACK || s == WHITE);
-     assert(c.x < b->width);
-     assert(c.y < b->height);
+     assert(b->width >= 2 && b->width <= 25);
+     assert(b->height >= 2 && b->height <= 25);
 
-     snprintf(param, sizeof(param), "%c %c%d",
-              s == BLACK ? 'b' : 'w',
-              'a' + (c.x) + !('a' + (c.x) < 'i'),
-              b->height - c.y);
+     /* ensure square board */
+     if (b->width != b->height) {
+          gtp_error("playing against a bot requiers a square board");
+     }
 
-     if (place_stone(b, s, c) >= 0) {
-          gtp_run_command(b, PLAY, param, NULL);
-          return true;
+     g = calloc(1, sizeof(struct Gtp));
+     if (!g) {
+          perror("calloc");
+          exit(EXIT_FAILURE);
+     }
+     g->board = b;
+     g->expected = 1;
+     g->serial = ++serials;
+     g->child.in = g->child.out = g->child.err = -1;
+
+     if (cmd) {
+          g->child.argv = engine_parse(cmd);
+          if (!g->child.argv) {
+               free(g);
+               return NULL;
+          }
+     } else {
+          engine_fds(&g->child, STDIN_FILENO, STDOUT_FILENO);
      }
 
-     return false;
+     /* keep connections in the order they were opened */
+     for (end = &connections; *end; end = &(*end)->next) {
+          n++;
+     }
+     if (n >= GTP_ENGINES) {
+          gtp_error("too many engines");
+     }
+     *end = g;
+
+     if (!gtp_init(g)) {
+          exit(EXIT_FAILURE);
+     }
+     return g;
 }
 
-
+/* Disconnect from engine G, and terminate it if sgo started it. */
+void
+gtp_close(struct Gtp *g)
+{
+     struct Gtp **p;
+     size_t i;
 
-static bool
-gtp_handle_respose(struct Query *q, struct Response *r)
-{
-     static const enum Form types[] = {
-          [PROTOCOL_VERSION]	= INT,
-          [NAME]		= STRING,
-          [QUIT]		= NIHIL,
-          [BOARDSIZE]		= NIHIL,
-          [CLEAR_BOARD]		= NIHIL,
-          [KOMI]		= NIHIL,
-          [PLAY]		= NIHIL,
-          [GENMOVE]		= VERTEX,
-          [UNDO]		= NIHIL,
-          [REG_GENMOVE]		= VERTEX,
-     };
+     for (p = &connections; *p; p = &(*p)->next) {
+          if (*p == g) {
+               *p = g->next;
+               break;
+          }
+     }
 
-     struct Obj obj = { .form = types[q->cmd] };
-     ssize_t i;
+     withdraw(g);
+     if (g->child.argv) {
+          engine_stop(&g->child);
+          for (i = 0; g->child.argv[i]; i++) {
+               free(g->child.argv[i]);
+          }
+          free(g->child.argv);
+     }
+     for (i = 0; i < QUERIES; i++) {
+          free(g->queries[i].line);
+     }
+     free(g->input.buf);
+     free(g->held);
+     free(g->iov);
+     free(g->name);
+     free(g->path);
+     free((void *) g->supported.name);
+     names_free(&g->supported);
+     free(g->listing);
+     free(g);
+}
 
-     if (r->error) {
-          obj.form = INVAL;
-          obj.val.v_str = r->resp;
-          return q->cb && q->cb(&obj, true);
+/* Let engine G play on BOARD from now on, e.g. to start a new game,
+ * and bring it up to date. */
+void
+gtp_attach(struct Gtp *g, struct Board *b)
+{
+     assert(b->width == g->board->width);
+
+     g->board = b;
+     gtp_batch_begin();
+     resync(g);
+     reanalyze(g);
+     gtp_batch_end();
+}
+
+/* Return the name engine G reported, or NULL if it isn't known yet. */
+const char *
+gtp_name(struct Gtp *g)
+{
+     return g->name;
+}
+
+/* Disconnect from all engines, and wait for them to exit. */
+void
+gtp_quit(void)
+{
+     while (connections) {
+          gtp_close(connections);
      }
+     engine_wait();
+}
 
-     switch (obj.form) {
-     case INT:
-          if (sscanf(r->resp, "%u", &obj.val.v_int) < 1) {
-               gtp_log("invalid int (%s)", r->resp);
-               return false;
-          }
+
+
+/* Write the GTP representation of vertex V on BOARD into BUF. */
+void
+gtp_format_vertex(struct Board *b, struct Vertex v, char buf[7])
+{
+     switch (v.type) {
+     case PASS:
+          strcpy(buf, "pass");
           break;
-     case FLOAT:
-          if (sscanf(r->resp, "%f", &obj.val.v_float) < 1) {
-               gtp_log("invalid float (%s)", r->resp);
-               return false;
-          }
+     case RESIGN:
+          strcpy(buf, "resign");
           break;
-     case STRING:
-          obj.val.v_str = r->resp;
+     case VALID:
+          /* X axis skips 'i', Y axis counts from the bottom up */
+          sprintf(buf, "%c%d",
+                  'a' + (v.coord.x) + !('a' + (v.coord.x) < 'i'),
+                  (b->height - v.coord.y) % 100);
           break;
-     case VERTEX: {
-          char token[r->len];
-          memset(token, 0, sizeof token);
-          sscanf(r->resp, "%s", token); /* chomp whitespaces */
+     }
+}
 
-          for (i = 0; i < r->len; i++) {
-               token[i] = (char) tolower(token[i]);
+/* Record that engine G has been told to play S at V. */
+static void
+step(struct Gtp *g, enum Stone s, struct Vertex v)
+{
+     struct Step *path;
+
+     if (g->depth == g->path_cap) {
+          g->path_cap = g->path_cap ? g->path_cap * 2 : 64;
+          path = realloc(g->path, g->path_cap * sizeof(struct Step));
+          if (!path) {
+               perror("realloc");
+               exit(EXIT_FAILURE);
           }
+          g->path = path;
+     }
+     g->path[g->depth++] = (struct Step) {
+          .player = s,
+          .placed = v.coord,
+          .pass = v.type == PASS,
+     };
+}
 
-          if (strcmp("pass", token) == 0) {
-               obj.val.v_vertex.type = PASS;
-          } else if (strcmp("resign", token) == 0) {
-               obj.val.v_vertex.type = RESIGN;
-          } else {
-               int j;
-               uint8_t x, y;
-               if ((j = sscanf(token, "%c%hhu", &x, &y)) < 2) {
-                    gtp_log("invalid vertex (%s)", token);
-                    return false;
-               }
+/* Update the moves engine G is believed to know about, after having
+ * sent it command C with the parameters PARAM. */
+static void
+track(struct Gtp *g, enum Command c, const char *param)
+{
+     struct Vertex v;
 
-               obj.val.v_vertex.type = VALID;
-               obj.val.v_vertex.coord = C(
-                    /* X axis starts with 'a', goes until 'I', skips
-                     * 'J', and continues until 'Z'. */
-                    (x - 'a') + (x <= 'i' ? 0 : 1),
-                    /* Y axis starts with 19, and goes down to 1. */
-                    q->b->height - y
-                    );
-
-               if ((obj.val.v_vertex.coord.x >= q->b->width) ||
-                   (obj.val.v_vertex.coord.y >= q->b->height)) {
-                    gtp_log("vertex out of bounds (<%s>: %d, %d)",
-                            token,
-                            obj.val.v_vertex.coord.x,
-                            obj.val.v_vertex.coord.y);
-                    return false;
-               }
+     switch (c) {
+     case BOARDSIZE:
+     case CLEAR_BOARD:
+          g->depth = 0;
+          break;
+     case UNDO:
+          if (g->depth > 0) {
+               g->depth--;
+          }
+          break;
+     case PLAY:
+          if (gtp_parse_vertex(g->board, param + 2, &v) && v.type != RESIGN) {
+               step(g, tolower(param[0]) == 'b' ? BLACK : WHITE, v);
           }
-     }
           break;
-     case NIHIL:
-          return false;
      default:
-          gtp_error("type handling not implemented");
+          ;
      }
+}
 
-     return q->cb && q->cb(&obj, false);
+/* Record that engine G played the move V it generated for query Q. */
+static void
+generated(struct Gtp *g, struct Query *q, struct Vertex v)
+{
+     size_t at = g->ponder.at;
+
+     if (!q->ahead) {
+          step(g, q->player == 'b' ? BLACK : WHITE, v);
+     } else if (g->depth > at && g->path[at].player == NONE) {
+          /* fill in the placeholder, unless it has been undone */
+          g->path[at].player = q->player == 'b' ? BLACK : WHITE;
+          g->path[at].placed = v.coord;
+          g->path[at].pass = v.type == PASS;
+     }
 }
 
-void
-gtp_check_responses(void)
+/* Handle a move the engine didn't accept, by replaying the game the
+ * next time it is brought up to date. */
+static bool
+rejected(struct Gtp *g, struct Obj *o, bool error)
 {
-     static int64_t id = -1;
-     static bool error;
-     static enum {
-          NORMAL,               /* between commands. expect a "=" or "?" */
-          ERROR,                /* command could not be parsed,  */
-          PRE_ID,
-          IN_ID,
-          PRE_RESPONSE,
-          IN_RESPONSE,
-          NEWLINE,
-          IN_COMMENT,
-     } state = NORMAL;
-
-     static size_t cap = 0, len = 0;
-     static char *resp = NULL, last = '\0';
-
-     struct Query *q, *q1, *qn;
-     struct Response *r, *r1, *rn;
-
-     char buf[BUFSIZ + 1];
-     size_t j;
-     int i;
-     buf[0] = last;
+     (void) o;
 
-     do {
-          /* attempt to read data from standard input */
-          i = read(STDIN_FILENO, buf + 1, sizeof(buf) - 1);
+     g->lost |= error;
+     return false;
+}
 
-          if (i <= 0) {
-               if (i == 0) {         /* end of file */
-                    fputs("unexpected end of file\n", stderr);
-                    exit(EXIT_FAILURE);
-               }
+/* Handle a failed undo command, by replaying the game from the start
+ * from now on. */
+static bool
+undone(struct Gtp *g, struct Obj *o, bool error)
+{
+     (void) o;
 
-               switch (errno) {
-               case EAGAIN:          /* no input */
-                    goto cross_ref;
-               default:              /* unknown error */
-                    exit(EXIT_FAILURE);
-               }
+     if (error && !g->no_undo) {
+          g->no_undo = true;
+          gtp_run_command(g, CLEAR_BOARD, NULL, NULL);
+          resync(g);
+     }
+     return false;
+}
+
+/* Bring engine G up to date with the current position on its board.
+ *
+ * The engine takes back its moves up to the last one the position
+ * shares with its own board, and then plays the rest of the moves.
+ * If that would require more commands than clearing the board and
+ * replaying the whole game (e.g. when starting a new game), the game
+ * is replayed instead. */
+static void
+resync(struct Gtp *g)
+{
+     struct Board *b = g->board;
+     struct Move *m, **path;
+     struct Step *p;
+     char param[1 + 1 + 7];
+     size_t n = 0, common, i;
+
+     g->ponder.player = NONE;   /* the speculation is undone as well */
+     for (m = b->history; m; m = m->before) {
+          n += !m->setup;
+     }
+     path = malloc(n * sizeof(struct Move *) + 1);
+     if (!path) {
+          perror("malloc");
+          exit(EXIT_FAILURE);
+     }
+     for (i = n, m = b->history; m; m = m->before) {
+          if (!m->setup) {
+               path[--i] = m;
           }
+     }
 
-          /* process parsed data */
-          for (j = 1; j < (size_t) i + 1; j++) {
-               switch (buf[j]) { /* preprocessing */
+     for (common = 0; common < n && common < g->depth; common++) {
+          p = &g->path[common];
+          m = path[common];
+          if (p->player != m->player || p->pass != m->pass ||
+              (!m->pass && (p->placed.x != m->placed.x ||
+                            p->placed.y != m->placed.y))) {
+               break;
+          }
+     }
 
-                    /* "Convert all occurences of HT to SPACE." */
-               case '\t':
-                    buf[j] = ' ';
-                    break;
+     gtp_batch_begin();
+     if (g->lost || (common < g->depth &&
+                     (g->no_undo || (g->depth - common) + (n - common) > n + 1))) {
+          gtp_run_command(g, CLEAR_BOARD, NULL, NULL);
+          g->lost = false;
+          common = 0;
+     }
+     while (g->depth > common) {
+          gtp_run_command(g, UNDO, NULL, undone);
+     }
+     for (i = common; i < n; i++) {
+          m = path[i];
+          param[0] = m->player == BLACK ? 'b' : 'w';
+          param[1] = ' ';
+          gtp_format_vertex(b, (struct Vertex) {
+                    .type = m->pass ? PASS : VALID,
+                    .coord = m->placed,
+               }, param + 2);
+          gtp_run_command(g, PLAY, param, NULL);
+     }
+     gtp_batch_end();
 
-                    /* "For each line with a hash sign (#), remove all
-                     * text following and including this
-                     * character."  */
-               case '#':
-                    state = IN_COMMENT;
-                    break;
+     free(path);
+}
 
-                    /* "Remove all occurences of CR and other control
-                     * characters except for HT and LF." */
-               case 0:  case 1:  case 2:  case 3:
-               case 4:  case 5:  case 6:  case 7:
-               case 8:  case 11: case 12: case 13:
-               case 14: case 15: case 16: case 17:
-               case 18: case 19: case 20: case 21:
-               case 22: case 23: case 24: case 25:
-               case 26: case 27: case 28: case 29:
-               case 30: case 31:
-                    buf[j] = buf[j - 1];
+/* Bring all engines playing on BOARD up to date, e.g. after having
+ * jumped to a different move. */
+void
+gtp_sync(struct Board *b)
+{
+     struct Gtp *g;
+
+     gtp_batch_begin();
+     for (g = connections; g; g = g->next) {
+          if (g->board == b) {
+               resync(g);
+               reanalyze(g);
+          }
+     }
+     gtp_batch_end();
+}
+
+/* Replace the analysis of G by an empty one, as the position
+ * changed. */
+static void
+forget(struct Gtp *g)
+{
+     memset(&g->analysis[!g->front], 0, sizeof(struct Analysis));
+     g->analysis[!g->front].updates = g->analysis[g->front].updates + 1;
+     g->front = !g->front;
+}
+
+/* Continue analysing on G after a command has interrupted the
+ * analysis, see gtp_analyze. */
+static void
+reanalyze(struct Gtp *g)
+{
+     struct Query *q = slot(g, g->counter);
+     char param[16];
+
+     if (!g->analyze ||
+         (q->id == g->counter && q->streaming && !q->done)) {
+          return;
+     }
+
+     forget(g);
+     snprintf(param, sizeof(param), "%u", g->interval);
+     gtp_run_command(g, g->analyze, param, NULL);
+}
+
+/* Handle the answer to the speculative move request of G. */
+static bool
+pondered(struct Gtp *g, struct Obj *o, bool error)
+{
+     if (error || o->val.v_vertex.type == RESIGN) {
+          g->ponder.player = NONE;
+          return false;
+     }
+     g->ponder.answered = true;
+     g->ponder.reply = o->val.v_vertex;
+     return false;
+}
+
+/* Let engine G think about its reply to S playing at C, while
+ * waiting for the actual move.  The engine is told to play the move,
+ * and asked for its reply.  If S plays at C, the next move request
+ * is answered by the reply, otherwise the engine takes back both
+ * moves. */
+void
+gtp_ponder(struct Gtp *g, enum Stone s, struct Coord c)
+{
+     char param[1 + 1 + 7] = { s == BLACK ? 'b' : 'w', ' ' };
+     uint32_t id;
+
+     if (g->dead || g->analyze || g->ponder.player != NONE) {
+          return;
+     }
+
+     gtp_batch_begin();
+     gtp_format_vertex(g->board, (struct Vertex) { .type = VALID, .coord = c },
+                       param + 2);
+     gtp_run_command(g, PLAY, param, NULL);
+
+     speculating = true;
+     id = gtp_run_command(g, GENMOVE, s == BLACK ? "w" : "b", pondered);
+     speculating = false;
+     if (g->dead || !id) {
+          gtp_batch_end();
+          return;
+     }
+
+     g->ponder.player = s;
+     g->ponder.guess = c;
+     g->ponder.hit = false;
+     g->ponder.id = id;
+     g->ponder.at = g->depth;
+     g->ponder.answered = false;
+     slot(g, id)->ahead = true;
+
+     /* the reply isn't known yet, but will have to be undone */
+     step(g, NONE, (struct Vertex) { .type = PASS });
+     gtp_batch_end();
+}
+
+/* Check if the move PARAM (e.g. "b a15") is the one engine G has
+ * been pondering about.  Otherwise the engine is brought up to date
+ * with its board, that already has the move. */
+static void
+guessed(struct Gtp *g, char *param)
+{
+     struct Vertex v;
+
+     if (tolower(param[0]) == (g->ponder.player == BLACK ? 'b' : 'w') &&
+         gtp_parse_vertex(g->board, param + 2, &v) && v.type == VALID &&
+         v.coord.x == g->ponder.guess.x && v.coord.y == g->ponder.guess.y) {
+          g->ponder.hit = true; /* and the engine has played it already */
+          return;
+     }
+     resync(g);
+}
+
+/* Let the move request for S to engine G be answered by the reply it
+ * has been pondering about, and return the ID of the speculative
+ * request, if it is still running.  Return 0 if the request has to
+ * be sent, or was already answered (see gtp_run_command). */
+static uint32_t
+adopt(struct Gtp *g, enum Stone s, callback cb)
+{
+     struct Query *q = slot(g, g->ponder.id);
+
+     if (!g->ponder.hit || s == g->ponder.player ||
+         (!g->ponder.answered && q->id != g->ponder.id)) {
+          resync(g);
+          return 0;
+     }
+     if (g->ponder.answered) {
+          return 0;             /* see reuse */
+     }
+     g->ponder.player = NONE;
+     q->speculative = false;
+     q->cb = cb;
+     if (verbose) {
+          fprintf(stderr, "waiting for pondered reply\n");
+     }
+     return q->id;
+}
+
+/* Answer the move request Q of G by the reply it pondered about. */
+static void
+reuse(struct Gtp *g, struct Query *q)
+{
+     g->ponder.player = NONE;
+     gtp_format_vertex(g->board, g->ponder.reply, q->answer);
+     if (verbose) {
+          fprintf(stderr, "pondered response: %s\n", q->answer);
+     }
+     q->resp = q->answer;
+     q->len = strlen(q->answer);
+     finish(g, q, false);
+}
+
+/* Tell all engines playing on BOARD, except for EXCEPT, about the
+ * move PARAM, e.g. "b a15". */
+static void
+gtp_tell(struct Board *b, struct Gtp *except, char *param)
+{
+     struct Gtp *g;
+
+     gtp_batch_begin();
+     for (g = connections; g; g = g->next) {
+          if (g->board != b || g == except) {
+               continue;
+          }
+          if (g->ponder.player != NONE && !g->ponder.hit) {
+               guessed(g, param);
+          } else {
+               gtp_run_command(g, PLAY, param, NULL);
+          }
+          reanalyze(g);
+     }
+     gtp_batch_end();
+}
+
+void
+gtp_pass(struct Board *b, enum Stone s)
+{
+     assert(b != NULL);
+     assert(s == BLACK || s == WHITE);
+
+     pass(b, s);
+     gtp_tell(b, NULL, s == BLACK ? "b pass" : "w pass");
+}
+
+/* place a STONE at COORD on BOARD and tell the engines */
+bool
+gtp_place_stone(struct Board *b, enum Stone s, struct Coord c)
+{
+     char param[1 + 1 + 7] = { s == BLACK ? 'b' : 'w', ' ' }; /* eg. "b a15" */
+
+     assert(b != NULL);
+     assert(s == BLACK || s == WHITE);
+     assert(c.x < b->width);
+     assert(c.y < b->height);
+
+     gtp_format_vertex(b, (struct Vertex) { .type = VALID, .coord = c },
+                   param + 2);
+
+     if (place_stone(b, s, c) >= 0) {
+          gtp_tell(b, NULL, param);
+          return true;
+     }
+
+     return false;
+}
+
+
+
+/* Parse the GTP vertex TOKEN on BOARD into V.  Return false if
+ * TOKEN is not a vertex on the board. */
+bool
+gtp_parse_vertex(struct Board *b, const char *token, struct Vertex *v)
+{
+     char x;
+     unsigned y;
+
+     if (strcasecmp("pass", token) == 0) {
+          v->type = PASS;
+          return true;
+     }
+     if (strcasecmp("resign", token) == 0) {
+          v->type = RESIGN;
+          return true;
+     }
+
+     if (sscanf(token, "%c%u", &x, &y) < 2) {
+          return false;
+     }
+     x = (char) tolower(x);
+     if (x < 'a' || x == 'i' || y < 1 || y > b->height) {
+          return false;
+     }
+
+     v->type = VALID;
+     v->coord = C(
+          /* X axis starts with 'a', goes until 'H', skips 'I', and
+           * continues until 'Z'. */
+          (x - 'a') - (x < 'i' ? 0 : 1),
+          /* Y axis starts with 19, and goes down to 1. */
+          b->height - y
+          );
+
+     return v->coord.x < b->width;
+}
+
+/* Pass the parsed response OBJ to the callback of query Q of G,
+ * after recording how long parsing took since START. */
+static bool
+invoke(struct Gtp *g, struct Query *q, struct Obj *obj, bool error,
+       uint64_t start)
+{
+     uint64_t t = clock_now_us();
+     bool changed;
+
+     latency_record(&latency[q->cmd][PARSE], t - start);
+     if (!q->cb) {
+          return false;
+     }
+     changed = q->cb(g, obj, error);
+     latency_record(&latency[q->cmd][CALLBACK], clock_now_us() - t);
+     return changed;
+}
+
+static bool
+gtp_handle_respose(struct Gtp *g, struct Query *q)
+{
+     struct Obj obj = { .form = q->form };
+     struct Board *b = g->board;
+     uint64_t start = clock_now_us();
+
+     if (q->error) {
+     invalid:
+          obj.form = INVAL;
+          obj.val.v_str = q->resp;
+          return invoke(g, q, &obj, true, start);
+     }
+
+     switch (obj.form) {
+     case INT:
+          if (sscanf(q->resp, "%u", &obj.val.v_int) < 1) {
+               gtp_log("invalid int (%s)", q->resp);
+               goto invalid;
+          }
+          break;
+     case FLOAT:
+          if (sscanf(q->resp, "%f", &obj.val.v_float) < 1) {
+               gtp_log("invalid float (%s)", q->resp);
+               goto invalid;
+          }
+          break;
+     case STRING:
+          obj.val.v_str = q->resp;
+          break;
+     case BOOL:                 /* as v_int */
+          if (!strncmp(q->resp, "true", 4) || !strncmp(q->resp, "false", 5)) {
+               obj.val.v_int = q->resp[0] == 't';
+          } else {
+               gtp_log("invalid boolean (%s)", q->resp);
+               goto invalid;
+          }
+          break;
+     case COLOR:
+          switch (tolower(q->resp[0])) {
+          case 'b':
+               obj.val.v_color = BLACK;
+               break;
+          case 'w':
+               obj.val.v_color = WHITE;
+               break;
+          default:
+               gtp_log("invalid color (%s)", q->resp);
+               goto invalid;
+          }
+          break;
+     case VERTEX: {
+          char token[q->len + 1];
+          memset(token, 0, sizeof token);
+          sscanf(q->resp, "%s", token); /* chomp whitespaces */
+
+          if (!gtp_parse_vertex(b, token, &obj.val.v_vertex)) {
+               gtp_log("invalid vertex (%s)", token);
+               goto invalid;
+          }
+
+          if (q->cached) {
+               struct Vertex v = obj.val.v_vertex;
+               v.coord = transform_coord(b, q->transform, v.coord);
+               cache_store(q->key, v);
+          }
+
+          /* the move has been played on the engine's board, so all
+           * other engines have to be told about it */
+          if (q->cmd == GENMOVE && obj.val.v_vertex.type != RESIGN) {
+               char param[1 + 1 + 7] = { q->player, ' ' };
+
+               if (q->written) { /* and not answered from the cache */
+                    generated(g, q, obj.val.v_vertex);
+               }
+               if (!q->speculative) {
+                    gtp_format_vertex(b, obj.val.v_vertex, param + 2);
+                    gtp_tell(b, g, param);
+               }
+          } else if (q->ahead) {
+               g->lost = true;
+          }
+     }
+          break;
+     case NIHIL:
+          latency_record(&latency[q->cmd][PARSE], clock_now_us() - start);
+          return false;
+     default:
+          gtp_error("type handling not implemented");
+     }
+
+     return invoke(g, q, &obj, false, start);
+}
+
+/* Skip over all queries of G that have already been answered. */
+static void
+advance(struct Gtp *g)
+{
+     while (g->expected != g->counter + 1 &&
+            (slot(g, g->expected)->id != g->expected ||
+             slot(g, g->expected)->done)) {
+          g->expected++;
+     }
+}
+
+/* Mark query Q of G as answered, and queue it to be dispatched. */
+static void
+finish(struct Gtp *g, struct Query *q, bool error)
+{
+     q->error = error;
+     q->done = true;
+     if (error && q->ahead) {
+          g->lost = true;       /* the placeholder is wrong */
+     }
+     q->answered = clock_now_us();
+     if (q->written && !q->streaming) {
+          latency_record(&latency[q->cmd][ENGINE], q->answered - q->written);
+     }
+     g->ready[g->ready_tail++ % QUERIES] = q->id;
+     advance(g);
+}
+
+/* Attach the response TEXT of length LEN to command ID of G.  The
+ * text is not copied, so it is only valid until the callback
+ * returns. */
+static void
+gtp_answer(struct Gtp *g, uint32_t id, bool error, char *text, size_t len)
+{
+     struct Query *q = slot(g, id);
+
+     if (q->id != id || q->done) {
+          fprintf(stderr, "orphaned response %u\n", id);
+          return;
+     }
+     if (id != g->expected) {
+          fprintf(stderr, "response %u out of order, expected %u\n",
+                  id, g->expected);
+     }
+
+     q->resp = text;
+     q->len = len;
+     g->alive = true;
+     g->failures = 0;
+     finish(g, q, error);
+}
+
+/* Fail query Q of G with the error message TEXT. */
+static void
+fail(struct Gtp *g, struct Query *q, const char *text)
+{
+     assert(strlen(text) < sizeof(q->answer));
+     q->resp = strcpy(q->answer, text);
+     q->len = strlen(text);
+     finish(g, q, true);
+}
+
+/* Take back the answer to the cancelled query Q of G.  A move that
+ * was generated has been played on the engine's board, and is undone
+ * there. */
+static void
+revoke(struct Gtp *g, struct Query *q)
+{
+     struct Vertex v;
+     char token[q->len + 1];
+
+     if (q->error || q->cmd != GENMOVE) {
+          return;
+     }
+
+     memset(token, 0, sizeof token);
+     sscanf(q->resp, "%s", token);
+     if (gtp_parse_vertex(g->board, token, &v) && v.type != RESIGN) {
+          generated(g, q, v);
+          if (g->no_undo) {
+               gtp_run_command(g, CLEAR_BOARD, NULL, NULL);
+               resync(g);
+          } else {
+               gtp_run_command(g, UNDO, NULL, undone);
+          }
+     }
+}
+
+/* Invoke the callbacks of all answered queries of G.  A callback may
+ * issue new commands, and thereby dispatch further queries itself. */
+static void
+dispatch(struct Gtp *g)
+{
+     struct Query *q;
+
+     while (g->ready_head != g->ready_tail) {
+          q = slot(g, g->ready[g->ready_head++ % QUERIES]);
+          if (q->cancelled) {
+               revoke(g, q);
+          } else {
+               g->board->changed |= gtp_handle_respose(g, q);
+          }
+          q->id = 0;
+          q->done = false;
+          q->cached = false;
+          q->cancelled = false;
+     }
+     advance(g);
+}
+
+
+
+/* Responses are read into a single buffer, and tokenized in place:
+ * Once the terminating empty line of a response has been read, the
+ * response is cleaned up (see gtp_next), and handed out as a slice
+ * of the buffer.  The consumed part of the buffer is reclaimed when
+ * more room is needed, and the buffer is only grown (by doubling
+ * its size) if a single response doesn't fit into it. */
+
+/* Make room for more input at the end of reader R. */
+static void
+room(struct Reader *r)
+{
+     if (r->start == r->end) {
+          r->start = r->end = r->scan = 0;
+     }
+
+     if (r->end == r->cap) {
+          if (r->start > 0) {
+               /* reclaim consumed input */
+               memmove(r->buf, r->buf + r->start, r->end - r->start);
+               r->end -= r->start;
+               r->scan -= r->start;
+               r->start = 0;
+          } else {
+               r->cap = r->cap ? r->cap * 2 : BUFSIZ;
+               r->buf = realloc(r->buf, r->cap);
+               if (!r->buf) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+               }
+          }
+     }
+}
+
+/* Read as much input as is available from FD into reader R.
+ *
+ * Returns the result of read(2). */
+ssize_t
+gtp_fill(struct Reader *r, int fd)
+{
+     ssize_t n;
+
+     room(r);
+     n = read(fd, r->buf + r->end, r->cap - r->end);
+     if (n > 0) {
+          r->end += n;
+     }
+     return n;
+}
+
+/* Append the N bytes of input at BUF to reader R. */
+static void
+feed(struct Reader *r, const char *buf, size_t n)
+{
+     size_t k;
+
+     while (n > 0) {
+          room(r);
+          k = r->cap - r->end < n ? r->cap - r->end : n;
+          memcpy(r->buf + r->end, buf, k);
+          r->end += k;
+          buf += k;
+          n -= k;
+     }
+}
+
+/* Check if C is a control character that GTP wants removed */
+#define ignored(c) ((unsigned char) (c) < ' ' && (c) != '\n' && (c) != '\t')
+
+/* Find the end of the next response in reader R, i.e. the position
+ * after two consecutive newlines, ignoring control characters in
+ * between.  Return 0 if the response is incomplete. */
+static size_t
+gtp_terminator(struct Reader *r)
+{
+     char *nl, *c, *end = r->buf + r->end;
+
+     for (c = r->buf + r->scan;
+          (nl = memchr(c, '\n', end - c));
+          c = nl + 1) {
+          for (c = nl + 1; c < end && ignored(*c); c++)
+               ;
+          if (c == end) {
+               /* continue at this newline, once there is more input */
+               r->scan = nl - r->buf;
+               return 0;
+          }
+          if (*c == '\n') {
+               return c + 1 - r->buf;
+          }
+     }
+
+     r->scan = r->end;
+     return 0;
+}
+
+/* Extract the next complete response from reader R into RESP.
+ *
+ * The response is preprocessed as described in the GTP
+ * specification, its ID and status are parsed and the text is
+ * terminated by a NUL byte, all within the reader's buffer.
+ * Responses that are not well-formed have a negative ID.  Return
+ * false if no complete response is available. */
+bool
+gtp_next(struct Reader *r, struct Response *resp)
+{
+     char *begin, *in, *out, *end, *c;
+     bool comment = false;
+     size_t term;
+
+     term = gtp_terminator(r);
+     if (!term) {
+          return false;
+     }
+
+     /* preprocess in place: remove control characters and
+      * comments, and convert tabs into spaces */
+     begin = in = out = r->buf + r->start;
+     end = r->buf + term;
+     for (; in < end; in++) {
+          if (ignored(*in)) {
+               continue;
+          }
+          if (*in == '#') {
+               comment = true;
+          } else if (*in == '\n') {
+               comment = false;
+          }
+          if (!comment) {
+               *out++ = *in == '\t' ? ' ' : *in;
+          }
+     }
+     r->start = r->scan = term;
+
+     /* strip the terminating newlines and leading empty lines */
+     while (out > begin && out[-1] == '\n') {
+          out--;
+     }
+     for (c = begin; c < out && isspace(*c); c++)
+          ;
+     *out = '\0';
+
+     *resp = (struct Response) { .id = -1, .text = c, .len = out - c };
+     if (c == out || (*c != '=' && *c != '?')) {
+          resp->malformed = true;
+          return true;
+     }
+     resp->error = *c++ == '?';
+
+     if (c < out && isdigit(*c)) {
+          for (resp->id = 0; c < out && isdigit(*c); c++) {
+               resp->id = resp->id * 10 + (*c - '0');
+          }
+     }
+     if (c < out && !isspace(*c)) {
+          resp->malformed = true;
+     }
+
+     /* the text of multi-line responses starts on the next line */
+     while (c < out && *c == ' ') {
+          c++;
+     }
+     if (c < out && *c == '\n') {
+          c++;
+     }
+
+     resp->text = c;
+     resp->len = out - c;
+     return true;
+}
+
+/* Extract the next complete line from reader R into LINE, for
+ * responses that are streamed line by line.  Control characters are
+ * removed and the line is terminated by a NUL byte instead of a
+ * newline, in place.  Return false if no complete line is
+ * available. */
+bool
+gtp_line(struct Reader *r, char **line, size_t *len)
+{
+     char *begin = r->buf + r->start, *nl, *in, *out;
+
+     if (r->start == r->end ||
+         !(nl = memchr(begin, '\n', r->end - r->start))) {
+          return false;
+     }
+
+     for (in = out = begin; in < nl; in++) {
+          if (!ignored(*in)) {
+               *out++ = *in == '\t' ? ' ' : *in;
+          }
+     }
+     *out = '\0';
+     r->start = r->scan = nl + 1 - r->buf;
+
+     *line = begin;
+     *len = out - begin;
+     return true;
+}
+
+/* Parse a line of analysis LINE from G, as sent in response to
+ * lz-analyze or kata-analyze, e.g.
+ *
+ *   info move D4 visits 120 winrate 5021 prior 1530 order 0 pv D4 Q16
+ *
+ * The line holds one or more candidate moves, each starting with
+ * "info", and replaces the previous analysis.  Winrates and priors
+ * are either given in 1/10000 (lz-analyze) or as fractions
+ * (kata-analyze). */
+static void
+parse_analysis(struct Gtp *g, char *line)
+{
+     struct Analysis *a = &g->analysis[!g->front];
+     struct Candidate *c = NULL, dummy;
+     struct Vertex v;
+     char *tok, *key = NULL, *save;
+     bool pv = false;
+     double d;
+
+     memset(a, 0, sizeof(*a));
+     for (tok = strtok_r(line, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+          if (!strcmp(tok, "info")) {
+               c = &dummy;
+               memset(c, 0, sizeof(*c));
+               key = NULL;
+               pv = false;
+               continue;
+          }
+          if (!c || !strncmp(tok, "ownership", 9) ||
+              !strcmp(tok, "movesOwnership")) {
+               break;           /* one value per point follows */
+          }
+
+          if (pv) {             /* the variation ends at the next key */
+               if (gtp_parse_vertex(g->board, tok, &v)) {
+                    if (c != &dummy && c->order == 0 && v.type == VALID &&
+                        a->pv_len < sizeof(a->pv) / sizeof(*a->pv)) {
+                         a->pv[a->pv_len++] = v.coord;
+                    }
+                    continue;
+               }
+               pv = false;
+          }
+
+          if (!key) {
+               if (!strcmp(tok, "pv")) {
+                    pv = true;
+               } else {
+                    key = tok;
+               }
+               continue;
+          }
+
+          if (!strcmp(key, "move")) {
+               if (!gtp_parse_vertex(g->board, tok, &v) || v.type != VALID) {
+                    c = &dummy;     /* e.g. pass */
+               } else {
+                    c = &a->move[v.coord.x + v.coord.y * g->board->width];
+               }
+          } else if (!strcmp(key, "visits")) {
+               c->visits = strtoul(tok, NULL, 10);
+               if (c != &dummy) {
+                    a->visits += c->visits;
+               }
+          } else if (!strcmp(key, "winrate") || !strcmp(key, "prior")) {
+               d = strtod(tok, NULL);
+               if (strchr(tok, '.')) {
+                    d *= 10000;
+               }
+               d = d < 0 ? 0 : d > 10000 ? 10000 : d;
+               *(!strcmp(key, "winrate") ? &c->winrate : &c->prior) = d;
+          } else if (!strcmp(key, "order")) {
+               c->order = strtoul(tok, NULL, 10);
+          }
+          key = NULL;
+     }
+
+     a->updates = g->analysis[g->front].updates + 1;
+     g->front = !g->front;
+}
+
+/* Check if the text from BEGIN to END holds nothing but control
+ * characters. */
+static bool
+blank(const char *begin, const char *end)
+{
+     for (; begin < end; begin++) {
+          if (!ignored(*begin)) {
+               return false;
+          }
+     }
+     return true;
+}
+
+/* Drop the updates of an analysis stream in reader R that have been
+ * overtaken by a later update, which replaces them anyway, without
+ * parsing them.  An engine may send updates faster than they can be
+ * parsed, but only the last one is ever shown. */
+static void
+overtaken(struct Reader *r)
+{
+     char *end = r->buf + r->end, *line, *nl, *next;
+
+     for (;;) {
+          line = r->buf + r->start;
+          if (line == end || !(nl = memchr(line, '\n', end - line)) ||
+              blank(line, nl)) {
+               return;          /* the stream might end here */
+          }
+          next = nl + 1;
+          if (next == end || !(nl = memchr(next, '\n', end - next)) ||
+              blank(next, nl)) {
+               return;
+          }
+          r->start = r->scan = next - r->buf;
+     }
+}
+
+/* Handle the next line of the stream answering query Q of G.
+ * Return false if no complete line is available. */
+static bool
+stream_line(struct Gtp *g, struct Query *q)
+{
+     char *line, *c;
+     size_t len;
+     uint32_t id = 0;
+
+     if (q->opened) {
+          overtaken(&g->input);
+     }
+     if (!gtp_line(&g->input, &line, &len)) {
+          return false;
+     }
+
+     if (!q->opened) {
+          if (len == 0) {
+               return true;     /* skip empty lines before the response */
+          }
+          if (line[0] != '=' && line[0] != '?') {
+               gtp_log("malformed response (%s)", line);
+               return true;
+          }
+
+          for (c = line + 1; isdigit(*c); c++) {
+               id = id * 10 + (*c - '0');
+          }
+          if (id != q->id) {
+               fprintf(stderr, "response %u out of order, expected %u\n",
+                       id, q->id);
+          }
+          g->alive = true;
+          g->failures = 0;
+
+          if (line[0] == '?') {
+               /* errors are not streamed, and end with an empty line
+                * just like any other response */
+               q->resp = strcpy(q->answer, "error");
+               q->len = strlen(q->answer);
+               finish(g, q, true);
+               dispatch(g);
+               return true;
+          }
+
+          /* only the time until the first update is of interest */
+          if (q->written) {
+               latency_record(&latency[q->cmd][ENGINE],
+                              clock_now_us() - q->written);
+          }
+
+          /* old results don't apply to the new position */
+          q->opened = true;
+          forget(g);
+
+          line = c;
+          while (*line == ' ') {
+               line++;
+          }
+          if (*line) {
+               parse_analysis(g, line);
+          }
+     } else if (len == 0) {     /* end of the stream */
+          q->resp = q->answer;
+          q->answer[0] = '\0';
+          q->len = 0;
+          finish(g, q, false);
+          dispatch(g);
+     } else if (q->id == g->counter) {
+          parse_analysis(g, line);
+     }                          /* else it is about an old position */
+
+     return true;
+}
+
+/* Start analysing the position on the board of G with the command
+ * CMD (LZ_ANALYZE or KATA_ANALYZE), printing updates every INTERVAL
+ * centiseconds.  Analysis is restarted every time the engine is told
+ * about a move, until gtp_interrupt is called. */
+void
+gtp_analyze(struct Gtp *g, enum Command cmd, unsigned interval)
+{
+     assert(cmd == LZ_ANALYZE || cmd == KATA_ANALYZE);
+
+     /* the other command is just as good */
+     if (g->lacking & 1u << cmd) {
+          cmd = cmd == LZ_ANALYZE ? KATA_ANALYZE : LZ_ANALYZE;
+     }
+     g->analyze = cmd;
+     g->interval = interval;
+     reanalyze(g);
+}
+
+/* Stop analysing on G, see gtp_analyze. */
+void
+gtp_interrupt(struct Gtp *g)
+{
+     struct Query *q = slot(g, g->counter);
+
+     g->analyze = 0;
+     memset(g->analysis, 0, sizeof(g->analysis));
+
+     /* any command ends the stream */
+     if (q->id == g->counter && q->streaming && !q->done) {
+          gtp_run_command(g, PROTOCOL_VERSION, NULL, gtp_ensure_version);
+     }
+}
+
+/* Return the latest analysis of the position on BOARD, or NULL if no
+ * engine is analysing it. */
+const struct Analysis *
+gtp_analysis(struct Board *b)
+{
+     struct Gtp *g;
+
+     for (g = connections; g; g = g->next) {
+          if (g->board == b && g->analyze) {
+               return &g->analysis[g->front];
+          }
+     }
+     return NULL;
+}
+
+/* Stop talking to the engine of G for good, e.g. after it crashed
+ * too often.  All commands that haven't been answered yet fail, and
+ * so will all commands issued from now on. */
+static void
+disconnect(struct Gtp *g)
+{
+     struct Query *q;
+     uint32_t id;
+
+     g->dead = true;
+     g->generation++;
+     for (id = g->expected; (int32_t) (g->counter - id) >= 0; id++) {
+          q = slot(g, id);
+          if (q->id == id && !q->done) {
+               fail(g, q, "dead\n");
+          }
+     }
+     g->sent = g->counter;
+     g->partial = 0;
+     g->blocked = false;
+     g->input.start = g->input.end = g->input.scan = 0;
+     withdraw(g);
+     if (g->child.argv) {
+          engine_stop(&g->child);
+     }
+}
+
+/* Replace the crashed or unresponsive engine of G by a new instance,
+ * or reconnect to an engine service, and bring it up to date with the
+ * current position.  Move requests that were lost are asked again,
+ * unless they ran out of time, everything else is covered by replaying
+ * the game.  An engine that can't be restarted, or keeps failing, is
+ * disconnected. */
+static void
+restart(struct Gtp *g, const char *why)
+{
+     static struct {
+          enum Command cmd;
+          callback cb;
+          char param[16];
+          unsigned retries;
+     } retry[QUERIES];
+     struct Query *q;
+     size_t n = 0, i;
+     uint32_t id;
+     uint64_t t = clock_now();
+
+     if (!g->child.argv || ++g->failures > MAX_FAILURES) {
+          fprintf(stderr, "engine %s, giving up\n", why);
+          disconnect(g);
+          return;
+     }
+     fprintf(stderr, "engine %s, restarting\n", why);
+     g->generation++;
+
+     gtp_batch_begin();
+
+     /* answers that didn't come from the engine are still valid */
+     dispatch(g);
+
+     for (id = g->expected; (int32_t) (g->counter - id) >= 0; id++) {
+          q = slot(g, id);
+          if (q->id != id || q->done) {
+               continue;
+          }
+          if (q->bounded && !q->cancelled && q->deadline <= t) {
+               fail(g, q, "timeout\n");
+               continue;
+          }
+          if (q->retries >= MAX_FAILURES && !q->cancelled) {
+               fail(g, q, "failed\n"); /* the engine keeps crashing */
+               continue;
+          }
+          if ((q->cmd == GENMOVE || q->cmd == REG_GENMOVE) && q->param &&
+              !q->cancelled && !q->speculative) {
+               retry[n].cmd = q->cmd;
+               retry[n].cb = q->cb;
+               snprintf(retry[n].param, sizeof(retry[n].param), "%.*s",
+                        (int) strcspn(q->param, "\n"), q->param);
+               retry[n].retries = q->retries + 1;
+               n++;
+          }
+          q->id = 0;
+          q->cached = false;
+     }
+     g->sent = g->counter;
+     g->partial = 0;
+     g->blocked = false;
+     advance(g);
+     g->input.start = g->input.end = g->input.scan = 0;
+
+     withdraw(g);
+     engine_stop(&g->child);
+     while (!gtp_init(g)) {
+          if (++g->failures > MAX_FAILURES) {
+               fprintf(stderr, "engine can't be restarted, giving up\n");
+               disconnect(g);
+               gtp_batch_end();
+               return;
+          }
+     }
+     resync(g);
+     for (i = 0; i < n; i++) {
+          id = gtp_run_command(g, retry[i].cmd, retry[i].param, retry[i].cb);
+          if (id) {
+               slot(g, id)->retries = retry[i].retries;
+          }
+     }
+     reanalyze(g);
+
+     gtp_batch_end();
+}
+
+/* Take the input held for G from io_uring, see completed.
+ *
+ * Returns the number of bytes taken like read(2), i.e. 0 at the
+ * end of file, or -1 with errno set if there is nothing to take. */
+static ssize_t
+take(struct Gtp *g)
+{
+     size_t n = g->held_len;
+
+     if (n > 0) {
+          feed(&g->input, g->held, n);
+          g->held_len = 0;
+          return n;
+     }
+     if (g->held_err < 0) {
+          return 0;
+     }
+     errno = g->held_err ? g->held_err : EAGAIN;
+     return -1;
+}
+
+/* reads from an engine at most per call of check_responses, so that
+ * an engine flooding sgo with output can't hold up anything else.
+ * Whatever is left is read after the next poll. */
+#define READS 4
+
+static void
+check_responses(struct Gtp *g)
+{
+     struct Response r;
+     unsigned reads;
+     ssize_t n;
+
+     /* callbacks may issue commands, which check for responses
+      * again.  In that case the new input will be handled by the
+      * outer invocation, as it still holds slices of the buffer. */
+     if (g->busy) {
+          return;
+     }
+     if (g->dead) {
+          dispatch(g);
+          return;
+     }
+     g->busy = true;
+
+     for (reads = 0; ; reads++) {
+          for (;;) {
+               struct Query *q = slot(g, g->expected);
+
+               if (g->expected != g->counter + 1 &&
+                   q->id == g->expected && q->streaming) {
+                    if (!stream_line(g, q)) {
+                         break;
+                    }
+                    continue;
+               }
+               if (!gtp_next(&g->input, &r)) {
+                    break;
+               }
+
+               if (r.malformed) {
+                    gtp_log("malformed response (%s)", r.text);
+               } else if (r.id >= 0) {
+                    gtp_answer(g, r.id, r.error, r.text, r.len);
+                    dispatch(g);
+               }
+          }
+
+          /* attempt to read data from the engine */
+          if (reads == READS) {
+               break;
+          }
+          n = uring ? take(g) : gtp_fill(&g->input, g->in);
+          if (n == 0) {         /* end of file */
+               restart(g, "exited unexpectedly");
+               break;
+          }
+          if (n < 0) {
+               if (errno != EAGAIN) {
+                    perror("read");
+                    restart(g, "can't be read from");
+               }
+               break;
+          }
+     }
+
+     /* dispatch responses that didn't come from the engine */
+     dispatch(g);
+     g->busy = false;
+
+     /* the window might have moved */
+     if (!batching && g->sent != g->counter) {
+          flush(g);
+     }
+}
+
+void
+gtp_check_responses(void)
+{
+     struct Gtp *g;
+
+     for (g = connections; g; g = g->next) {
+          check_responses(g);
+     }
+}
+
+/* Return true if responses are waiting to be dispatched by
+ * gtp_check_responses, or input has been read but not looked at,
+ * regardless of any new input. */
+bool
+gtp_pending(void)
+{
+     struct Gtp *g;
+
+     for (g = connections; g; g = g->next) {
+          if (g->ready_head != g->ready_tail ||
+              g->held_len || g->held_err) {
+               return true;
+          }
+     }
+     return false;
+}
+
+/* Mix the string S, including its terminator, into KEY (FNV-1a). */
+static uint64_t
+mix(uint64_t key, const char *s)
+{
+     do {
+          key = (key ^ (uint8_t) *s) * 0x100000001b3;
+     } while (*s++);
+     return key;
+}
+
+/* Calculate the cache key for a move request by STONE to G.
+ *
+ * The key combines the canonical position with everything else
+ * that might influence the engine's answer: its name, the command
+ * line it was started with and the commands given by gtp_setup. */
+static uint64_t
+cache_key(struct Gtp *g, enum Stone s, uint8_t *transform)
+{
+     union { float f; uint32_t i; } k = { .f = komi ? strtof(komi, NULL) : -1 };
+     /* with komi, swapping the colours changes who is ahead */
+     uint64_t key = board_key(g->board, s, k.f == 0, transform);
+     char **arg;
+     size_t i;
+
+     key = mix(key, g->name);
+     for (arg = g->child.argv; arg && *arg; arg++) {
+          key = mix(key, *arg);
+     }
+     for (i = 0; i < nsetup; i++) {
+          key = mix(key, setup[i]);
+     }
+
+     return key ^ ((uint64_t) k.i << 32);
+}
+
+/* Attempt to answer a move request by STONE for query Q of G from
+ * the cache.  Return true if a response was queued. */
+static bool
+cache_answer(struct Gtp *g, struct Query *q, enum Stone s)
+{
+     struct Vertex v;
+     char param[1 + 1 + 7] = { s == BLACK ? 'b' : 'w', ' ' };
+
+     if (!cache_lookup(q->key, &v)) {
+          return false;
+     }
+     v.coord = untransform_coord(g->board, q->transform, v.coord);
+     gtp_format_vertex(g->board, v, param + 2);
+
+     /* genmove also plays the move on the engine's board */
+     if (q->cmd == GENMOVE && v.type != RESIGN) {
+          gtp_run_command(g, PLAY, param, NULL);
+     }
+
+     if (verbose) {
+          fprintf(stderr, "cached response: %s\n", param);
+     }
+
+     /* the response is not dispatched immediately, so that the
+      * caller can finish its state transition first. */
+     assert(strlen(param + 2) < sizeof(q->answer));
+     strcpy(q->answer, param + 2);
+     q->resp = q->answer;
+     q->len = strlen(q->answer);
+     finish(g, q, false);
+
+     return true;
+}
+
+/* Return the last ID of G that may be written. */
+static uint32_t
+window_end(struct Gtp *g)
+{
+     uint32_t last = g->expected - 1 + window;
+
+     return (int32_t) (last - g->counter) > 0 ? g->counter : last;
+}
+
+/* Account for W bytes of the commands of G having been written. */
+static void
+wrote(struct Gtp *g, size_t w)
+{
+     struct Query *q;
+     uint64_t t = clock_now_us();
+     uint32_t id, last = window_end(g);
+
+     for (id = g->sent + 1; (int32_t) (last - id) >= 0; id++) {
+          size_t rest;
+
+          q = slot(g, id);
+          if (q->id != id || !q->line_len) {
+               g->sent = id;
+               continue;
+          }
+
+          rest = q->line_len - g->partial;
+          if (w < rest) {
+               g->partial += w;
+               break;
+          }
+          w -= rest;
+          g->partial = 0;
+          g->sent = id;
+          q->written = t;
+          latency_record(&latency[q->cmd][WAIT], t - q->queued);
+     }
+}
+
+/* Handle the failure of writing to G, as reported in errno. */
+static void
+write_failed(struct Gtp *g)
+{
+     switch (errno) {
+     case EPIPE:
+          restart(g, "stopped reading commands");
+          return;
+     case ECONNREFUSED:         /* connecting to a service failed */
+     case ECONNRESET:
+     case ENOTCONN:
+     case ETIMEDOUT:
+     case EHOSTUNREACH:
+     case ENETUNREACH:
+          perror("writev");
+          restart(g, "can't be reached");
+          return;
+     default:
+          perror("writev");
+          exit(EXIT_FAILURE);
+     }
+}
+
+/* Write as many queued commands of G as the window allows with a
+ * single system call.  With io_uring, the write is only queued, and
+ * submitted together with those to all other engines, see
+ * gtp_fds. */
+static void
+flush(struct Gtp *g)
+{
+     struct iovec local[IOVS], *iov = uring ? g->iov : local;
+     struct Query *q;
+     uint32_t id, last;
+     ssize_t w;
+     int n;
+
+     g->blocked = false;
+     if (g->dead) {
+          g->sent = g->counter;
+          return;
+     }
+     if (g->writing) {          /* continued once the write completes */
+          return;
+     }
+     for (;;) {
+          last = window_end(g);
+
+          /* collect commands, skipping those answered locally */
+          for (n = 0, id = g->sent + 1;
+               (int32_t) (last - id) >= 0 && n < IOVS;
+               id++) {
+               q = slot(g, id);
+               if (q->id != id || !q->line_len) {
                     continue;
                }
+               iov[n].iov_base = q->line;
+               iov[n].iov_len = q->line_len;
+               if (n == 0) {
+                    iov[n].iov_base = q->line + g->partial;
+                    iov[n].iov_len -= g->partial;
+               }
+               n++;
+          }
+          if (n == 0) {
+               g->sent = last;
+               g->partial = 0;
+               return;
+          }
 
-               switch (state) {
-               case NORMAL:
-                    switch (buf[j]) {
-                    case '=':
-                         error = false;
-                         state = PRE_ID;
-                         break;
-                    case '?':
-                         error = true;
-                         state = PRE_ID;
-                         break;
-                    case ' ':
-                         break;
-                    case '\n':
-                         state = NEWLINE;
-                         break;
-                    default:
-                         state = ERROR;
-                         break;
-                    }
-                    break;
-               case PRE_ID:
-                    if (buf[j] == '\n') {
-                          /* command without ID */
-                         state = NORMAL;
-                    } else if (isspace(buf[j])) {
-                         /* continue */
-                    } else if (isdigit(buf[j])) {
-                         state = IN_ID;
-                         j--;
-                    } else {
-                         state = ERROR;
-                    }
-                    break;
-               case IN_ID:
-                    if (isdigit(buf[j])) {
-                         if (id < 0) {
-                              id = 0;
-                         } else {
-                              id *= 10;
-                         }
-                         id += buf[j] - '0';
-                    } else if (buf[j] == '\n') {
-                         state = NEWLINE;
-                    } else if (isspace(buf[j])) {
-                         state = PRE_RESPONSE;
-                    } else {
-                         state = ERROR;
-                    }
-                    break;
-               case PRE_RESPONSE:
-                    if (buf[j] == '\n') {
-                         if (buf[j - 1] == '\n') {
-                              state = NORMAL;
-                         } else {
-                              state = NEWLINE;
-                         }
-                    } else if (!isspace(buf[j])) {
-                         state = IN_RESPONSE;
-                         j--;
-                    }
-                    break;
-               case IN_RESPONSE:
-                    if (buf[j] == '\n') {
-                         state = NEWLINE;
-                    }
-
-                    assert(len <= cap);
-                    if (len == cap) {
-                         resp = realloc(resp, cap + 64);
-                         if (!resp) {
-                              perror("realloc");
-                              exit(EXIT_FAILURE);
-                         }
-                         memset(resp + cap, 0, 64);
-                         cap += 64;
-                    }
-                    resp[len] = buf[j];
-                    len++;
-                    break;
-               case NEWLINE:
-                    if (buf[j] == '\n') {
-                         struct Response *r;
-
-                         state = NORMAL;
-
-                         if (id < 0) {
-                              break;
-                         }
-
-                         r = malloc(sizeof(struct Response));
-                         if (!r) {
-                              perror("malloc");
-                              exit(EXIT_FAILURE);
-                         }
-
-                         if (len == cap) {
-                              resp = realloc(resp, cap + 1);
-                              if (!resp) {
-                                   perror("realloc");
-                                   exit(EXIT_FAILURE);
-                              }
-                         }
-                         resp[len++] = '\0';
-
-                         *r = (struct Response) {
-                              .id = id,
-                              .error = error,
-                              .resp = resp,
-                              .len = len,
-                              .next = responses,
-                         };
-                         responses = r;
-
-                         id = -1;
-                         len = cap = 0;
-                         resp = NULL;
-                    } else {
-                         state = IN_RESPONSE;
-                    }
-                    break;
-               case IN_COMMENT:
-                    if (buf[j] == '\n') {
-                         state = NEWLINE;
-                    }
-                    break;
-               case ERROR:
-                    /* continue until two consecutive newlines are
-                     * reached */
-                    if (buf[j] == '\n' && buf[j - 1] == '\n') {
-                         id = -1;
-                         len = cap = 0;
-                         free(resp);
-                         resp = NULL;
-
-                         state = NORMAL;
-                         break;
-                    }
+          if (uring) {
+               uring_writev(g->out, iov, n, request(g, OUTPUT));
+               g->writing = true;
+               return;
+          }
+          w = writev(g->out, iov, n);
+          if (w < 0) {
+               if (errno == EINTR) {
+                    continue;
                }
+               if (errno == EAGAIN) {
+                    g->blocked = true;
+               } else {
+                    write_failed(g);
+               }
+               return;
+          }
+
+          /* figure out how far we got */
+          wrote(g, w);
+     }
+}
 
-               last = buf[j];
+/* Hold the N bytes read from G at BUF, until check_responses takes
+ * them. */
+static void
+hold(struct Gtp *g, const char *buf, size_t n)
+{
+     char *held;
+
+     if (g->held_len + n > g->held_cap) {
+          g->held_cap = g->held_len + n > 2 * g->held_cap
+               ? g->held_len + n : 2 * g->held_cap;
+          held = realloc(g->held, g->held_cap);
+          if (!held) {
+               perror("realloc");
+               exit(EXIT_FAILURE);
           }
-     } while (i == sizeof(buf));
+          g->held = held;
+     }
+     memcpy(g->held + g->held_len, buf, n);
+     g->held_len += n;
+}
+
+/* Handle the io_uring request C that has completed. */
+static void
+completed(struct Completion *c)
+{
+     struct Gtp *g;
 
-cross_ref:
-     /* after checking the new responses, attempt to cross-reference
-      * them with the queries. */
+     for (g = connections; g && g->serial != c->data >> 34; g = g->next)
+          ;
+     if (!g || g->dead || c->data != request(g, c->data & 3)) {
+          uring_release(c);     /* cancelled, or from before a restart */
+          return;
+     }
 
-     for (q1 = NULL, q = queries; q; q1 = q, q = qn) {
-          qn = q->next;         /* prevent use-after-free */
+     switch ((enum Request) (c->data & 3)) {
+     case INPUT:
+          if (c->res > 0) {
+               hold(g, c->buf, c->res);
+               uring_read(g->in, request(g, INPUT));
+          } else if (c->res == 0) {
+               g->held_err = -1;
+          } else if (c->res == -EAGAIN) {
+               uring_poll(g->in, POLLIN, request(g, READABLE));
+          } else if (c->res == -EINTR || c->res == -ENOBUFS ||
+                     c->res == -ECANCELED) {
+               uring_read(g->in, request(g, INPUT));
+          } else {
+               g->held_err = -c->res;
+          }
+          uring_release(c);
+          /* in gtp_run_command, other engines have to wait */
+          if (!g->busy && (!waiting || waiting == g)) {
+               check_responses(g);
+          }
+          break;
+     case READABLE:
+          uring_read(g->in, request(g, INPUT));
+          break;
+     case OUTPUT:
+          g->writing = false;
+          if (c->res >= 0) {
+               wrote(g, c->res);
+               flush(g);
+          } else if (c->res == -EAGAIN) {
+               uring_poll(g->out, POLLOUT, request(g, WRITABLE));
+               g->writing = true;
+          } else if (c->res == -EINTR || c->res == -ECANCELED) {
+               flush(g);
+          } else {
+               errno = -c->res;
+               write_failed(g);
+          }
+          break;
+     case WRITABLE:
+          g->writing = false;
+          flush(g);
+          break;
+     }
+}
 
-          for (r1 = NULL, r = responses; r; r1 = r, r = rn) {
-               rn = r->next;    /* prevent use-after-free */
+/* Handle all io_uring requests that have completed so far. */
+static void
+reap(void)
+{
+     struct Completion c;
 
-               if (q->id == r->id) {
-                    /* when the query ID matches the response ID,
-                     * parse the response and call the callback
-                     * function. */
-                    q->b->changed |= gtp_handle_respose(q, r);
+     while (uring_next(&c)) {
+          completed(&c);
+     }
+}
 
-                    /* remove response object */
-                    if (r1) {
-                         r1->next = r->next;
-                    } else {
-                         responses = r->next;
-                    }
-                    free(r->resp);
-                    free(r);
-
-                    /* remove query object */
-                    if (q1) {
-                         q1->next = q->next;
-                    } else {
-                         queries = q->next;
-                    }
-                    free(q);
-                    break;
+/* Add the file descriptors of engine G to FDS, which has room for at
+ * least GTP_FDS entries.  Return the number of entries used. */
+static size_t
+fds_of(struct Gtp *g, struct pollfd *fds)
+{
+     g->nfds = 0;
+     if (g->dead) {
+          return 0;
+     }
+     if (!uring) {              /* see gtp_fds */
+          fds[g->nfds++] = (struct pollfd) { .fd = g->in, .events = POLLIN };
+          fds[g->nfds++] = (struct pollfd) {
+               .fd = g->out,
+               /* wait for the engine to accept more commands */
+               .events = g->blocked ? POLLOUT : 0,
+          };
+     }
+     if (g->child.err >= 0) {
+          fds[g->nfds++] = (struct pollfd) {
+               .fd = g->child.err,
+               .events = POLLIN,
+          };
+     }
+
+     return g->nfds;
+}
+
+/* Add the file descriptors of all engines to FDS, which has room for
+ * N entries, i.e. GTP_FDS for every connection.  Return the number
+ * of entries used.
+ *
+ * With io_uring, the writes queued so far are submitted, and the
+ * ring takes the place of the input and output of all engines. */
+size_t
+gtp_fds(struct pollfd *fds, size_t n)
+{
+     struct Gtp *g;
+     size_t i = 0;
+
+     if (uring && connections) {
+          uring_submit();
+          fds[i++] = (struct pollfd) { .fd = uring_fd(), .events = POLLIN };
+     }
+     for (g = connections; g; g = g->next) {
+          assert(i + (uring ? 1 : GTP_FDS) <= n);
+          i += fds_of(g, fds + i);
+     }
+
+     return i;
+}
+
+/* Return the number of milliseconds until the next command of G
+ * times out, or -1 if there is no deadline. */
+static int
+timeout(struct Gtp *g)
+{
+     struct Query *q;
+     uint64_t t, min = 0;
+     uint32_t id;
+
+     for (id = g->expected; (int32_t) (g->counter - id) >= 0; id++) {
+          q = slot(g, id);
+          if (q->id == id && !q->done && q->deadline &&
+              (!min || q->deadline < min)) {
+               min = q->deadline;
+          }
+     }
+     if (!min) {
+          return -1;
+     }
+
+     t = clock_now();
+     return t >= min ? 0 : (int) (min - t);
+}
+
+/* Handle the events that poll reported for the entries in FDS that
+ * were added by fds_of for engine G. */
+static void
+events_of(struct Gtp *g, struct pollfd *fds)
+{
+     unsigned gen = g->generation;
+     size_t i;
+
+     /* after a restart, the descriptors in FDS are stale */
+     for (i = 0; i < g->nfds && gen == g->generation; i++) {
+          if (fds[i].fd == g->child.err && g->child.err >= 0) {
+               if (fds[i].revents) {
+                    engine_stderr(&g->child);
+               }
+          } else if (fds[i].fd == g->in) {
+               if (fds[i].revents & (POLLIN | POLLHUP)) {
+                    check_responses(g);
+               } else if (fds[i].revents & (POLLERR | POLLNVAL)) {
+                    restart(g, "failed");
                }
+          } else if (fds[i].fd == g->out && fds[i].revents) {
+               /* errors are reported by writev */
+               flush(g);
           }
      }
 
-     return;
+     if (timeout(g) == 0) {
+          restart(g, "timed out");
+     }
 }
 
+/* Handle the events that poll reported for the N entries in FDS, as
+ * prepared by gtp_fds, and check if any engine is running late. */
 void
-gtp_run_command(struct Board *b, enum Command c, char *param, callback cb)
+gtp_events(struct pollfd *fds, size_t n)
 {
-     struct Query *q;
-     static uint32_t counter = 0;
-     char *cmd;
+     struct Gtp *g;
+     size_t i = 0;
 
-     switch (c) {
-     case PROTOCOL_VERSION:	cmd = "protocol_version"; break;
-     case NAME:			cmd = "name"; break;
-     case KNOWN_COMMAND:	cmd = "known_command"; break;
-     case LIST_COMMANDS:	cmd = "list_commands"; break;
-     case QUIT:			cmd = "quit"; break;
-     case BOARDSIZE:		cmd = "boardsize"; break;
-     case CLEAR_BOARD:		cmd = "clear_board"; break;
-     case KOMI:			cmd = "komi"; break;
-     case PLAY:			cmd = "play"; break;
-     case GENMOVE:		cmd = "genmove"; break;
-     case UNDO:			cmd = "undo"; break;
-     case REG_GENMOVE:		cmd = "reg_genmove"; break;
-     default:
-          abort();
+     if (uring && n > 0) {
+          reap();
+          i++;
+     }
+     for (g = connections; g && i + g->nfds <= n; g = g->next) {
+          events_of(g, fds + i);
+          i += g->nfds;
      }
 
-     /* initialize query object (parsed response + ) */
-     q = malloc(sizeof(struct Query));
-     if (!q) {
-          perror("malloc");
+     if (report) {
+          report = 0;
+          gtp_latency(stderr, report_json);
+     }
+}
+
+/* Print the latency of all commands sent so far to F, as a table or
+ * as a JSON object. */
+void
+gtp_latency(FILE *f, bool json)
+{
+     unsigned c, s;
+     bool first = true;
+
+     if (json) {
+          fputc('{', f);
+     } else {
+          fprintf(f, "%-16s %-8s %8s %10s %10s %10s %10s %10s %10s\n",
+                  "command", "stage", "count", "mean",
+                  "p50", "p90", "p99", "p99.9", "max (ms)");
+     }
+     for (c = 0; c < LENGTH(commands); c++) {
+          if (!latency[c][WAIT].count && !latency[c][PARSE].count) {
+               continue;
+          }
+          if (json) {
+               fprintf(f, "%s\n \"%s\": {", first ? "" : ",",
+                       commands[c] ? commands[c] : "raw");
+          }
+          for (s = 0; s < STAGES; s++) {
+               if (json) {
+                    fprintf(f, "%s\"%s\": ", s ? ", " : "", stages[s]);
+               } else {
+                    fprintf(f, "%-16s %-8s ",
+                            commands[c] ? commands[c] : "raw", stages[s]);
+               }
+               latency_print(f, &latency[c][s], json);
+          }
+          if (json) {
+               fputc('}', f);
+          }
+          first = false;
+     }
+     if (json) {
+          fputs("\n}\n", f);
+     }
+     fflush(f);
+}
+
+/* Estimate how many ms pass between asking for a move, and the move
+ * being handled, that the engine doesn't spend thinking.  This is the
+ * typical time a command waits to be sent, plus the time an engine
+ * takes to answer a command that requires no thought, plus the time
+ * sgo takes to handle a move. */
+uint64_t
+gtp_overhead(void)
+{
+     const struct Latency *move = latency[GENMOVE];
+     uint64_t us;
+
+     us = latency_percentile(&move[WAIT], 50)
+          + latency_percentile(&latency[PLAY][ENGINE], 50)
+          + latency_percentile(&move[PARSE], 50)
+          + latency_percentile(&move[CALLBACK], 50);
+     return (us + 999) / 1000;
+}
+
+static void
+request_report(int sig)
+{
+     (void) sig;
+     report = 1;
+}
+
+/* Print the latency statistics (see gtp_latency) to standard error
+ * whenever the signal SIG is received, once gtp_events is called. */
+void
+gtp_latency_on(int sig, bool json)
+{
+     struct sigaction sa = { .sa_handler = request_report };
+
+     report_json = json;
+     sigemptyset(&sa.sa_mask);
+     if (sigaction(sig, &sa, NULL) < 0) {
+          perror("sigaction");
           exit(EXIT_FAILURE);
      }
+}
 
-     *q = (struct Query) {
-          .id      = ++counter,
-          .cmd     = c,
-          .cb      = cb,
-          .b       = b,
-          .next    = queries,
-     };
-     queries = q;
+/* Return the number of milliseconds until the next command of any
+ * engine times out, or a stopped engine has to be checked on again,
+ * or -1 if there is no deadline. */
+int
+gtp_timeout(void)
+{
+     struct Gtp *g;
+     int t, min = -1;
 
-     /* send command */
-     if (param) {
-          if (debug) {
-               fprintf(stderr, "run: %d %s %s\n", counter, cmd, param);
+     for (g = connections; g; g = g->next) {
+          t = timeout(g);
+          if (t >= 0 && (min < 0 || t < min)) {
+               min = t;
           }
-          printf("%d %s %s\n", counter, cmd, param);
+     }
+
+     /* restarted engines are collected while waiting */
+     t = engine_reap();
+     if (t >= 0 && (min < 0 || t < min)) {
+          min = t;
+     }
+     return min;
+}
+
+/* Limit the number of commands in flight per engine to N. */
+void
+gtp_window(unsigned n)
+{
+     window = n > 0 && n <= QUERIES ? n : QUERIES;
+}
+
+/* Talk to all engines through io_uring, instead of polling and
+ * reading from every one of them on its own.  Has to be called
+ * before any engine is opened.  Return false if the system doesn't
+ * support io_uring, in which case engines are polled. */
+bool
+gtp_uring(void)
+{
+     assert(!connections);
+     return uring = uring_open();
+}
+
+/* Start queuing commands, instead of sending them immediately.
+ * Batches may be nested. */
+void
+gtp_batch_begin(void)
+{
+     batching++;
+}
+
+/* Send all commands queued since the matching gtp_batch_begin. */
+void
+gtp_batch_end(void)
+{
+     struct Gtp *g;
+
+     assert(batching > 0);
+     if (--batching) {
+          return;
+     }
+
+     for (g = connections; g; g = g->next) {
+          flush(g);
+     }
+     gtp_check_responses();
+}
+
+/* Send the command C with the parameters PARAM (or NULL) to engine
+ * G, and pass the response to CB, if not NULL.  Return the ID of the
+ * command, see gtp_deadline and gtp_cancel, or 0 if it was dropped,
+ * in which case CB is never called. */
+uint32_t
+gtp_run_command(struct Gtp *g, enum Command c, char *param, callback cb)
+{
+     struct Query *q;
+     const char *cmd;
+     enum Stone s;
+     uint32_t id;
+
+     if (c == RAW) {            /* the command is all in PARAM */
+          cmd = param;
+          param = NULL;
      } else {
-          if (debug) {
-               fprintf(stderr, "run: %d %s\n", counter, cmd);
+          cmd = gtp_command_name(c);
+     }
+     if (c == PLAY && !cb) {
+          cb = rejected;        /* see track */
+     }
+     if (c == GENMOVE && !speculating && g->ponder.player != NONE &&
+         (id = adopt(g, tolower(param[0]) == 'b' ? BLACK : WHITE, cb))) {
+          return id;
+     }
+
+     /* wait for the slot to become free, if too many commands are
+      * in flight.  Only this engine has to be waited for, the input
+      * of others that arrives meanwhile is left for later.
+      *
+      * Answers at hand are dispatched right away.  Input can't be
+      * read from within a callback of the engine though, and the
+      * slot of the query whose callback is running is only freed
+      * once it returns, so the command is dropped instead of waiting
+      * forever.  The engine is then brought up to date again by the
+      * next gtp_sync. */
+     q = slot(g, g->counter + 1);
+     while (q->id) {
+          struct pollfd pfd[GTP_FDS];
+          size_t n;
+
+          if (g->ready_head != g->ready_tail) {
+               dispatch(g);
+               continue;
+          }
+          if (g->busy || q->done) {
+               fprintf(stderr, "%s: too many commands in flight, dropping %s\n",
+                       g->name ? g->name : "engine", cmd);
+               g->lost = true;
+               return 0;
+          }
+
+          gtp_log("query ring full, waiting for %u", q->id);
+          flush(g);
+          if (uring) {
+               uring_submit();
+               n = 1;
+               pfd[0] = (struct pollfd) { .fd = uring_fd(), .events = POLLIN };
+          } else {
+               n = fds_of(g, pfd);
+          }
+          if (poll(pfd, n, timeout(g)) < 0 && errno != EINTR) {
+               perror("poll");
+               exit(EXIT_FAILURE);
+          }
+          if (uring) {
+               struct Gtp *outer = waiting;
+
+               waiting = g;
+               reap();
+               waiting = outer;
+               g->nfds = 0;
+          }
+          events_of(g, pfd);
+     }
+
+     /* initialize query object */
+     q->id        = ++g->counter;
+     q->cmd       = c;
+     q->form      = c == RAW ? raw_form : forms[c];
+     q->cb        = cb;
+     q->cached    = false;
+     q->done      = false;
+     q->line_len  = 0;
+     q->param     = NULL;
+     q->deadline  = 0;
+     q->streaming = c == LZ_ANALYZE || c == KATA_ANALYZE;
+     q->opened    = false;
+     q->queued    = clock_now_us();
+     q->written   = 0;
+     q->bounded   = false;
+     q->cancelled = false;
+     q->retries   = 0;
+     q->speculative = speculating;
+     q->ahead     = false;
+
+     if (g->dead) {
+          fail(g, q, "dead\n");
+          return q->id;
+     }
+     if (c != RAW && g->lacking & 1u << c) {
+          fail(g, q, "unsupported\n");
+          return q->id;
+     }
+     track(g, c, param);
+
+     /* check if the response is already known */
+     if (c == GENMOVE || c == REG_GENMOVE) {
+          q->player = (char) tolower(param[0]);
+     }
+     if (c == GENMOVE && g->ponder.player != NONE && !speculating) {
+          reuse(g, q);
+          return q->id;
+     }
+     if ((c == GENMOVE || c == REG_GENMOVE) && g->name && !speculating) {
+          s = q->player == 'b' ? BLACK : WHITE;
+          q->key = cache_key(g, s, &q->transform);
+          if (cache_answer(g, q, s)) {
+               return q->id;
           }
-          printf("%d %s\n", counter, cmd);
+          q->cached = true;
      }
+
+     /* queue command */
      if (debug) {
-          printf("showboard\n");
+          fprintf(stderr, "run: %d %s %s\n", g->counter, cmd, param ? param : "");
      }
-     fflush(stdout);
+     for (;;) {
+          int n = snprintf(q->line, q->line_cap, "%u %s%s%s\n%s",
+                           g->counter, cmd,
+                           param ? " " : "", param ? param : "",
+                           debug ? "showboard\n" : "");
+          if (n < 0) {
+               perror("snprintf");
+               exit(EXIT_FAILURE);
+          }
+          if ((size_t) n < q->line_cap) {
+               q->line_len = n;
+               break;
+          }
 
-     b->changed = false;
-     gtp_check_responses();
+          q->line_cap = n + 1;
+          q->line = realloc(q->line, q->line_cap);
+          if (!q->line) {
+               perror("realloc");
+               exit(EXIT_FAILURE);
+          }
+     }
+
+     if (param) {
+          q->param = q->line + q->line_len - strlen(param) - 1
+               - (debug ? strlen("showboard\n") : 0);
+     }
+     if (!q->streaming && (!g->alive ? startup_timeout : response_timeout)) {
+          q->deadline = clock_now() + 1000 *
+               (uint64_t) (!g->alive ? startup_timeout : response_timeout);
+     }
+     if ((c == GENMOVE || c == REG_GENMOVE) && move_timeout) {
+          gtp_deadline(g, q->id, move_timeout * 1000);
+     }
+
+     if (batching) {
+          return q->id;
+     }
+     flush(g);
+
+     g->board->changed = false;
+     check_responses(g);
+     return q->id;
+}
+
+/* Send the command LINE, that sgo doesn't know, to engine G, and pass
+ * the response to CB as an object of FORM.  LINE consists of the
+ * name of the command and its parameters, and must not change the
+ * position on the engine's board.  Return the ID of the command, see
+ * gtp_run_command. */
+uint32_t
+gtp_run_raw(struct Gtp *g, char *line, enum Form form, callback cb)
+{
+     assert(!strpbrk(line, "\r\n"));
+
+     raw_form = form;
+     return gtp_run_command(g, RAW, line, cb);
+}
+
+/* Return true if engine G supports the command NAME, according to
+ * the list it reported.  Until the list is known, every command is
+ * assumed to be supported. */
+bool
+gtp_supports(struct Gtp *g, const char *name)
+{
+     return !g->supported.slots || names_find(&g->supported, name) >= 0;
+}
+
+/* Send the raw command LINE (see gtp_run_raw) to every engine once it
+ * has started, e.g. to set engine specific parameters. */
+void
+gtp_setup(const char *line)
+{
+     const char **s = realloc(setup, (nsetup + 1) * sizeof(char *));
+
+     if (!s) {
+          perror("realloc");
+          exit(EXIT_FAILURE);
+     }
+     setup = s;
+     setup[nsetup++] = line;
+}
+
+/* Give the engine G MS milliseconds to answer command ID.  If it
+ * doesn't, the command fails, and the engine is restarted. */
+void
+gtp_deadline(struct Gtp *g, uint32_t id, unsigned ms)
+{
+     struct Query *q = slot(g, id);
+     uint64_t deadline = clock_now() + ms;
+
+     if (!id || q->id != id || q->done) {
+          return;
+     }
+     if (!q->deadline || deadline < q->deadline) {
+          q->deadline = deadline;
+     }
+     q->bounded = true;
+}
+
+/* Drop command ID sent to engine G, so that its callback is never
+ * invoked.  A move that is generated anyway is undone, and an engine
+ * that doesn't answer soon is restarted. */
+void
+gtp_cancel(struct Gtp *g, uint32_t id)
+{
+     struct Query *q = slot(g, id);
+
+     if (!id || q->id != id || q->cancelled) {
+          return;
+     }
+     q->cancelled = true;
+     if (!q->done) {
+          gtp_deadline(g, id, CANCEL_GRACE);
+     }
 }
@@ -16,6 +16,8 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <poll.h>
+#include <sys/types.h>
 
 #include "board.h"
 
@@ -35,6 +37,13 @@ enum Command {
      GENMOVE,
      UNDO,
      REG_GENMOVE,
+     LZ_ANALYZE,
+     KATA_ANALYZE,
+     TIME_SETTINGS,
+     TIME_LEFT,
+     VERSION,
+     FINAL_SCORE,
+     RAW,                       /* any other command, see gtp_run_raw */
 };
 
 enum Form {
@@ -71,14 +80,91 @@ struct Obj {
      uint64_t		len;	/* used by LIST */
 };
 
-/* A callback processes and object with an error state.
+/* Buffered input from an engine, see gtp_fill */
+struct Reader {
+     char	*buf;
+     size_t	 cap;
+     size_t	 start;		/* first unconsumed byte */
+     size_t	 end;		/* end of input */
+     size_t	 scan;		/* where to look for the end of a response */
+};
+
+/* A response as extracted by gtp_next */
+struct Response {
+     int64_t	 id;		/* negative if missing */
+     bool	 error;
+     bool	 malformed;
+     char	*text;		/* points into the reader's buffer */
+     size_t	 len;
+};
+
+/* The latest analysis of the position by an engine, see gtp_analyze.
+ * Every update replaces all previous results. */
+struct Analysis {
+     uint32_t	 updates;	/* number of updates received so far */
+     uint32_t	 visits;	/* total of all candidates */
+     struct Candidate {
+	  uint32_t	visits;	/* 0 if the move wasn't considered */
+	  uint16_t	winrate; /* for the side to move, in 1/10000 */
+	  uint16_t	prior;	/* in 1/10000 */
+	  uint8_t	order;	/* rank among all candidates, 0 is best */
+     } move[25 * 25];		/* indexed by x + y * width */
+     uint8_t	 pv_len;
+     struct Coord pv[32];	/* principal variation of the best move */
+};
+
+/* A connection to an engine, see gtp_open */
+struct Gtp;
+
+/* A callback processes and object with an error state, as sent by
+ * an engine.
  *
  * If the board was changed, it returns true. */
-typedef bool (*callback)(struct Obj*, bool);
+typedef bool (*callback)(struct Gtp*, struct Obj*, bool);
+
+/* maximal number of file descriptors per engine added by gtp_fds */
+#define GTP_FDS 3
+
+/* maximal number of engines connected at once */
+#define GTP_ENGINES 256
 
-void gtp_run_command(struct Board *, enum Command, char *, callback);
-void gtp_init(struct Board *);
+const char *gtp_command_name(enum Command);
+bool gtp_command(const char *, enum Command *);
+bool gtp_parse_vertex(struct Board *, const char *, struct Vertex *);
+void gtp_format_vertex(struct Board *, struct Vertex, char [7]);
+struct Gtp *gtp_open(struct Board *, const char *);
+void gtp_close(struct Gtp *);
+void gtp_attach(struct Gtp *, struct Board *);
+const char *gtp_name(struct Gtp *);
+void gtp_analyze(struct Gtp *, enum Command, unsigned);
+void gtp_interrupt(struct Gtp *);
+const struct Analysis *gtp_analysis(struct Board *);
+void gtp_quit(void);
+uint32_t gtp_run_command(struct Gtp *, enum Command, char *, callback);
+uint32_t gtp_run_raw(struct Gtp *, char *, enum Form, callback);
+bool gtp_supports(struct Gtp *, const char *);
+void gtp_setup(const char *);
+void gtp_deadline(struct Gtp *, uint32_t, unsigned);
+void gtp_cancel(struct Gtp *, uint32_t);
+void gtp_timeouts(unsigned, unsigned, unsigned);
+void gtp_sync(struct Board *);
+void gtp_ponder(struct Gtp *, enum Stone, struct Coord);
 void gtp_check_responses(void);
+size_t gtp_fds(struct pollfd *, size_t);
+void gtp_events(struct pollfd *, size_t);
+int gtp_timeout(void);
+void gtp_latency(FILE *, bool);
+void gtp_latency_on(int, bool);
+uint64_t gtp_overhead(void);
+void gtp_time_settings(struct Gtp *, unsigned, unsigned, unsigned);
+void gtp_window(unsigned);
+bool gtp_uring(void);
+void gtp_batch_begin(void);
+void gtp_batch_end(void);
+ssize_t gtp_fill(struct Reader *, int);
+bool gtp_next(struct Reader *, struct Response *);
+bool gtp_line(struct Reader *, char **, size_t *);
+bool gtp_pending(void);
 bool gtp_place_stone(struct Board *, enum Stone, struct Coord);
 void gtp_pass(struct Board *, enum Stone);
      
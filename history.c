@@ -0,0 +1,473 @@
+/* Memory management for the move history
+ *
+ * Copyright 2020-2021 Philip Kaludercic
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "board.h"
+#include "history.h"
+
+/* All moves are allocated and freed using the functions in this
+ * file, so that the memory used by the history can be kept track
+ * of.  If a budget has been set, and the history grows beyond it,
+ * history_trim will write variations that are not part of the
+ * current line of play into a spill file, and replace them by a
+ * "stub" move that only remembers what move was played and where to
+ * find the rest on disk.  These stubs have to be loaded again using
+ * history_load, before a variation can be followed.
+ *
+ * The spill file is only ever appended to, and removed when sgo
+ * exits. */
+
+static struct HistoryStats stats;
+static size_t budget = SIZE_MAX;
+static FILE *spill;
+static uint64_t spill_end;
+
+/* Serialized form of a move.  A subtree is written in pre-order,
+ * preceded by a Blob header, each move being followed by its
+ * removed stones. */
+struct Blob {
+     uint32_t length;           /* bytes following the header */
+     uint32_t nodes;
+};
+
+struct Node {
+     uint8_t  player;
+     uint8_t  x, y;
+     uint8_t  flags;
+     uint16_t children;
+     uint16_t removed_n;
+     uint64_t spill;            /* for moves that were already stubs */
+};
+
+#define N_PASS  (1 << 0)
+#define N_SETUP (1 << 1)
+
+#define move_size(m)                                    \
+     (sizeof(struct Move) +                             \
+      sizeof(struct Coord) * (m)->removed_n +           \
+      sizeof(struct Move *) * (m)->children)
+
+#define checkpoint_size(b)                              \
+     (sizeof(struct Checkpoint) +                       \
+      sizeof(enum Stone) * (b)->width * (b)->height)
+
+/* Allocate a move with room for REMOVED stones. */
+struct Move *
+history_alloc(uint16_t removed)
+{
+     struct Move *m;
+
+     m = calloc(1, sizeof(struct Move) + sizeof(struct Coord) * removed);
+     if (!m) {
+          perror("calloc");
+          abort();
+     }
+
+     m->removed_n = removed;
+     stats.nodes++;
+     stats.bytes += move_size(m);
+     return m;
+}
+
+/* Add CHILD as a followup move of PARENT. */
+void
+history_link(struct Move *parent, struct Move *child)
+{
+     assert(parent);
+
+     child->before = parent;
+     child->depth = parent->depth + 1;
+     parent->followed = parent->children;
+     parent->after = realloc(parent->after,
+                             sizeof(struct Move *) * (parent->children + 1));
+     if (!parent->after) {
+          perror("realloc");
+          abort();
+     }
+     parent->after[parent->children++] = child;
+     stats.bytes += sizeof(struct Move *);
+}
+
+/* Free move M, but none of its children. */
+void
+history_release(struct Move *m)
+{
+     assert(stats.nodes > 0);
+     stats.nodes--;
+     stats.bytes -= move_size(m);
+     stats.bytes -= m->checkpoint ? m->checkpoint->size : 0;
+     free(m->checkpoint);
+     free(m->after);
+     free(m);
+}
+
+/* Remember M as the last visited followup of its parent. */
+void
+history_follow(struct Move *m)
+{
+     uint16_t i;
+
+     for (i = 0; m->before && i < m->before->children; i++) {
+          if (m->before->after[i] == m) {
+               m->before->followed = i;
+          }
+     }
+}
+
+/* Save the position on BOARD, if the current move is due for a
+ * checkpoint. */
+void
+history_checkpoint(struct Board *b)
+{
+     struct Move *m = b->history;
+     struct Checkpoint *cp;
+
+     if (m->depth % CHECKPOINT || m->checkpoint || m->setup) {
+          return;
+     }
+
+     cp = malloc(checkpoint_size(b));
+     if (!cp) {
+          perror("malloc");
+          abort();
+     }
+
+     cp->size = checkpoint_size(b);
+     cp->black_captured = b->black_captured;
+     cp->white_captured = b->white_captured;
+     memcpy(cp->hash, b->hash, sizeof(b->hash));
+     memcpy(cp->board, b->board, sizeof(enum Stone) * b->width * b->height);
+
+     m->checkpoint = cp;
+     stats.bytes += cp->size;
+}
+
+/* Find the move on BOARD that NAV refers to, loading it from the
+ * spill file if necessary.  N is only used by NAV_MOVE.
+ *
+ * Return NULL if there is no such move. */
+struct Move *
+history_find(struct Board *b, enum Nav nav, uint16_t n)
+{
+     struct Move *m = b->history, *p = m->before;
+     uint16_t i;
+
+     switch (nav) {
+     case NAV_FIRST:
+          while (m->before) {
+               m = m->before;
+          }
+          return m;
+     case NAV_BACK:
+          return p;
+     case NAV_FORWARD:
+          if (!m->children) {
+               return NULL;
+          }
+          return history_load(m->after[m->followed]);
+     case NAV_LAST:
+          while (m->children) {
+               m = history_load(m->after[m->followed]);
+          }
+          return m;
+     case NAV_PREV_VARIATION:
+     case NAV_NEXT_VARIATION:
+          if (!p) {
+               return NULL;
+          }
+          for (i = 0; p->after[i] != m; i++)
+               ;
+          if (nav == NAV_PREV_VARIATION && i > 0) {
+               return history_load(p->after[i - 1]);
+          }
+          if (nav == NAV_NEXT_VARIATION && i + 1 < p->children) {
+               return history_load(p->after[i + 1]);
+          }
+          return NULL;
+     case NAV_MOVE:
+          while (m->depth > n) {
+               m = m->before;
+          }
+          while (m->depth < n && m->children) {
+               m = history_load(m->after[m->followed]);
+          }
+          return m;
+     }
+
+     return NULL;
+}
+
+/* Set the memory budget for all histories to BYTES. */
+void
+history_budget(size_t bytes)
+{
+     budget = bytes;
+}
+
+struct HistoryStats
+history_stats(void)
+{
+     return stats;
+}
+
+/* Append the subtree starting at M to BUF, growing it as needed. */
+static void
+serialize(struct Move *m, char **buf, size_t *len, size_t *cap, uint32_t *nodes)
+{
+     struct Node n = {
+          .player = m->player,
+          .x = m->placed.x,
+          .y = m->placed.y,
+          .flags = (m->pass ? N_PASS : 0) | (m->setup ? N_SETUP : 0),
+          .children = m->children,
+          .removed_n = m->removed_n,
+          .spill = m->spill,
+     };
+     size_t need = sizeof(n) + sizeof(struct Coord) * m->removed_n;
+     uint16_t i;
+
+     while (*len + need > *cap) {
+          *cap = *cap ? *cap * 2 : 4096;
+          *buf = realloc(*buf, *cap);
+          if (!*buf) {
+               perror("realloc");
+               abort();
+          }
+     }
+
+     memcpy(*buf + *len, &n, sizeof(n));
+     memcpy(*buf + *len + sizeof(n), m->removed,
+            sizeof(struct Coord) * m->removed_n);
+     *len += need;
+     (*nodes)++;
+
+     for (i = 0; i < m->children; i++) {
+          serialize(m->after[i], buf, len, cap, nodes);
+     }
+}
+
+/* Recursively free the subtree starting at M */
+static void
+drop(struct Move *m)
+{
+     uint16_t i;
+
+     for (i = 0; i < m->children; i++) {
+          drop(m->after[i]);
+     }
+     history_release(m);
+}
+
+/* Write the subtree starting at M to the spill file, and replace it
+ * by a stub in its parent.  Return false if nothing was written. */
+static bool
+spill_subtree(struct Move *m)
+{
+     struct Move *stub, *parent = m->before;
+     struct Blob blob = {0};
+     char *buf = NULL;
+     size_t len = 0, cap = 0;
+     uint16_t i;
+
+     assert(parent);
+
+     if (!spill) {
+          spill = tmpfile();
+          if (!spill) {
+               perror("tmpfile");
+               return false;
+          }
+     }
+
+     serialize(m, &buf, &len, &cap, &blob.nodes);
+     blob.length = len;
+
+     if (pwrite(fileno(spill), &blob, sizeof(blob), spill_end) != sizeof(blob) ||
+         pwrite(fileno(spill), buf, len, spill_end + sizeof(blob)) != (ssize_t) len) {
+          perror("spill");
+          free(buf);
+          return false;
+     }
+     free(buf);
+
+     stub = history_alloc(0);
+     stub->player = m->player;
+     stub->placed = m->placed;
+     stub->pass = m->pass;
+     stub->setup = m->setup;
+     stub->before = parent;
+     stub->depth = parent->depth + 1;
+     stub->spill = spill_end + 1;
+
+     for (i = 0; i < parent->children; i++) {
+          if (parent->after[i] == m) {
+               parent->after[i] = stub;
+          }
+     }
+
+     spill_end += sizeof(blob) + len;
+     stats.spilled++;
+     drop(m);
+
+     return true;
+}
+
+/* Ensure the history of BOARD doesn't exceed the memory budget.
+ *
+ * Variations closer to the root of the game are considered colder,
+ * and are spilled to disk first.  The current line of play is always
+ * kept in memory. */
+void
+history_trim(struct Board *b)
+{
+     struct Move *m, **path;
+     size_t depth = 0, i;
+     uint16_t j;
+
+     if (stats.bytes <= budget) {
+          return;
+     }
+
+     for (m = b->history; m; m = m->before) {
+          depth++;
+     }
+     path = malloc(sizeof(struct Move *) * depth);
+     if (!path) {
+          perror("malloc");
+          abort();
+     }
+     for (i = depth, m = b->history; m; m = m->before) {
+          path[--i] = m;
+     }
+
+     /* walk down the current line, starting at the root */
+     for (i = 0; i + 1 < depth && stats.bytes > budget / 4 * 3; i++) {
+          m = path[i];
+          for (j = 0; j < m->children; j++) {
+               struct Move *c = m->after[j];
+
+               if (c != path[i + 1] && resident(c) &&
+                   (c->children || c->removed_n)) {
+                    spill_subtree(c);
+               }
+          }
+     }
+
+     free(path);
+}
+
+/* Recursively rebuild a subtree from BUF, consuming its contents. */
+static struct Move *
+deserialize(char **buf, char *end, struct Move *parent)
+{
+     struct Move *m;
+     struct Node n;
+     uint16_t i;
+
+     if (*buf + sizeof(n) > end) {
+          return NULL;
+     }
+     memcpy(&n, *buf, sizeof(n));
+     *buf += sizeof(n);
+
+     if (*buf + sizeof(struct Coord) * n.removed_n > end) {
+          return NULL;
+     }
+
+     m = history_alloc(n.removed_n);
+     m->player = n.player;
+     m->placed = C(n.x, n.y);
+     m->pass = n.flags & N_PASS;
+     m->setup = n.flags & N_SETUP;
+     m->spill = n.spill;
+     memcpy(m->removed, *buf, sizeof(struct Coord) * n.removed_n);
+     *buf += sizeof(struct Coord) * n.removed_n;
+     history_link(parent, m);
+
+     for (i = 0; i < n.children; i++) {
+          if (!deserialize(buf, end, m)) {
+               return NULL;
+          }
+     }
+
+     return m;
+}
+
+/* Load the variation starting at STUB back into memory.
+ *
+ * The stub is replaced by the loaded move in the tree, and freed.
+ * Return the loaded move, or STUB if it was already resident. */
+struct Move *
+history_load(struct Move *stub)
+{
+     struct Move *parent = stub->before, *m, *tmp;
+     struct Blob blob;
+     char *buf, *pos;
+     uint16_t i;
+
+     if (resident(stub)) {
+          return stub;
+     }
+
+     if (pread(fileno(spill), &blob, sizeof(blob), stub->spill - 1) != sizeof(blob)) {
+          perror("spill");
+          abort();
+     }
+     buf = malloc(blob.length);
+     if (!buf) {
+          perror("malloc");
+          abort();
+     }
+     if (pread(fileno(spill), buf, blob.length,
+               stub->spill - 1 + sizeof(blob)) != (ssize_t) blob.length) {
+          perror("spill");
+          abort();
+     }
+
+     /* TMP temporarily stands in for the parent, so that the loaded
+      * move can be linked into the tree in place of the stub, and
+      * the loaded moves are numbered from where the stub was */
+     tmp = history_alloc(0);
+     tmp->depth = parent->depth;
+     pos = buf;
+     m = deserialize(&pos, buf + blob.length, tmp);
+     if (!m) {
+          fputs("spill: corrupt subtree\n", stderr);
+          abort();
+     }
+     free(buf);
+     history_release(tmp);
+
+     m->before = parent;
+     for (i = 0; i < parent->children; i++) {
+          if (parent->after[i] == stub) {
+               parent->after[i] = m;
+          }
+     }
+     history_release(stub);
+     stats.loaded++;
+
+     return m;
+}
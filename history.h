@@ -0,0 +1,55 @@
+/* Copyright 2020-2021 Philip Kaludercic
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "board.h"
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+struct HistoryStats {
+     size_t	nodes;          /* resident moves */
+     size_t	bytes;          /* memory used by resident moves */
+     size_t	spilled;        /* subtrees written to disk */
+     size_t	loaded;         /* subtrees read back from disk */
+};
+
+#define resident(m) ((m)->spill == 0)
+
+enum Nav {
+     NAV_FIRST,                 /* root of the game */
+     NAV_LAST,                  /* end of the current line */
+     NAV_BACK,                  /* previous move */
+     NAV_FORWARD,               /* last visited followup move */
+     NAV_PREV_VARIATION,        /* previous sibling */
+     NAV_NEXT_VARIATION,        /* next sibling */
+     NAV_MOVE,                  /* N-th move on the current line */
+};
+
+struct Move	*history_alloc(uint16_t);
+void		 history_link(struct Move *, struct Move *);
+void		 history_release(struct Move *);
+void		 history_budget(size_t);
+void		 history_trim(struct Board *);
+struct Move	*history_load(struct Move *);
+void		 history_follow(struct Move *);
+void		 history_checkpoint(struct Board *);
+struct Move	*history_find(struct Board *, enum Nav, uint16_t);
+struct HistoryStats history_stats(void);
+
+#endif
@@ -0,0 +1,209 @@
+/* Game journal
+ *
+ * Copyright 2020-2021 Philip Kaludercic
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "board.h"
+#include "journal.h"
+
+/* A journal starts with a header, identifying the file and the board
+ * size, followed by one fixed-size record for every change made to
+ * the board.  Records are written as soon as they are made, so they
+ * survive sgo itself crashing, but they are only synced to the disk
+ * when sgo is idle (see journal_sync), so that playing a move never
+ * has to wait for the disk. */
+
+#define MAGIC "sgoj"
+
+struct Header {
+     char     magic[4];
+     uint8_t  width;
+     uint8_t  height;
+     uint8_t  pad[2];
+};
+
+struct Record {
+     uint8_t  type;             /* enum Entry */
+     uint8_t  player;           /* enum Stone */
+     uint8_t  x, y;
+};
+
+/* Open the journal FILE, or create it for a board of WIDTH and
+ * HEIGHT if it doesn't exist yet.  The board size of an existing
+ * journal is stored in the returned object.
+ *
+ * Return NULL if the journal cannot be used, after printing an
+ * error. */
+struct Journal *
+journal_open(const char *file, uint8_t width, uint8_t height)
+{
+     struct Header h = { .magic = MAGIC, .width = width, .height = height };
+     struct Journal *j;
+     ssize_t n;
+     int fd;
+
+     fd = open(file, O_RDWR | O_CREAT | O_APPEND, 0644);
+     if (fd < 0) {
+          perror(file);
+          return NULL;
+     }
+
+     n = read(fd, &h, sizeof(h));
+     if (n == 0) {              /* new journal */
+          h = (struct Header) { .magic = MAGIC, .width = width, .height = height };
+          if (write(fd, &h, sizeof(h)) != sizeof(h)) {
+               perror(file);
+               close(fd);
+               return NULL;
+          }
+     } else if (n != sizeof(h) || memcmp(h.magic, MAGIC, sizeof(h.magic))) {
+          fprintf(stderr, "%s: not a journal\n", file);
+          close(fd);
+          return NULL;
+     }
+
+     j = malloc(sizeof(struct Journal));
+     if (!j) {
+          perror("malloc");
+          abort();
+     }
+
+     *j = (struct Journal) {
+          .fd = fd,
+          .width = h.width,
+          .height = h.height,
+     };
+
+     return j;
+}
+
+/* Apply all changes recorded in journal J to BOARD, and attach the
+ * journal to the board, so that all further changes are recorded. */
+void
+journal_replay(struct Journal *j, struct Board *b)
+{
+     struct Record *r, *rs;
+     struct stat st;
+     size_t n, i;
+     ssize_t k;
+
+     assert(j->width == b->width && j->height == b->height);
+
+     if (fstat(j->fd, &st) < 0) {
+          perror("fstat");
+          abort();
+     }
+
+     /* read all records in one go */
+     n = (st.st_size - sizeof(struct Header)) / sizeof(struct Record);
+     rs = malloc(n * sizeof(struct Record) + 1);
+     if (!rs) {
+          perror("malloc");
+          abort();
+     }
+     k = pread(j->fd, rs, n * sizeof(struct Record), sizeof(struct Header));
+     if (k < 0) {
+          perror("pread");
+          abort();
+     }
+     n = k / sizeof(struct Record);
+
+     for (i = 0; i < n; i++) {
+          r = &rs[i];
+          switch (r->type) {
+          case J_PLACE:
+               if (r->x >= b->width || r->y >= b->height ||
+                   place_stone(b, r->player, C(r->x, r->y)) < 0) {
+                    fprintf(stderr, "journal: invalid move %u\n", (unsigned) i);
+               }
+               break;
+          case J_PASS:
+               pass(b, r->player);
+               break;
+          case J_UNDO:
+               undo_move(b);
+               break;
+          default:
+               fprintf(stderr, "journal: invalid record %u\n", (unsigned) i);
+          }
+     }
+     free(rs);
+
+     /* drop a partially written record, left over from a crash */
+     if ((st.st_size - sizeof(struct Header)) % sizeof(struct Record) &&
+         ftruncate(j->fd, sizeof(struct Header) + n * sizeof(struct Record)) < 0) {
+          perror("ftruncate");
+     }
+
+     j->entries = n;
+     b->journal = j;
+}
+
+/* Record a change of TYPE by STONE at COORD in journal J. */
+void
+journal_append(struct Journal *j, enum Entry type, enum Stone s, struct Coord c)
+{
+     struct Record r = {
+          .type = type,
+          .player = s,
+          .x = c.x,
+          .y = c.y,
+     };
+
+     if (write(j->fd, &r, sizeof(r)) != sizeof(r)) {
+          perror("journal");
+          return;
+     }
+
+     j->entries++;
+     j->dirty = true;
+}
+
+/* Ensure everything written to journal J has reached the disk. */
+void
+journal_sync(struct Journal *j)
+{
+     if (!j || !j->dirty) {
+          return;
+     }
+
+     if (fdatasync(j->fd) < 0) {
+          perror("fdatasync");
+     }
+     j->dirty = false;
+}
+
+void
+journal_close(struct Journal *j)
+{
+     if (!j) {
+          return;
+     }
+
+     journal_sync(j);
+     close(j->fd);
+     free(j);
+}
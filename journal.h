@@ -0,0 +1,45 @@
+/* Copyright 2020-2021 Philip Kaludercic
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "board.h"
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+enum Entry {
+     J_PLACE,
+     J_PASS,
+     J_UNDO,
+};
+
+struct Journal {
+     int	fd;
+     uint8_t	width;
+     uint8_t	height;
+     bool	dirty;          /* written but not synced */
+     uint32_t	entries;
+};
+
+struct Journal	*journal_open(const char *, uint8_t, uint8_t);
+void		 journal_replay(struct Journal *, struct Board *);
+void		 journal_append(struct Journal *, enum Entry, enum Stone, struct Coord);
+void		 journal_sync(struct Journal *);
+void		 journal_close(struct Journal *);
+
+#endif
@@ -0,0 +1,110 @@
+/* Latency histograms
+ *
+ * Copyright 2020-2021 Philip Kaludercic
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+
+#include "latency.h"
+
+/* Values below 32 have a bucket of their own.  Above that, a value
+ * with its highest bit at position B is shifted right by B - 4 bits,
+ * leaving 16 distinct values per power of two, that follow the
+ * buckets of the previous power of two. */
+#define SUB 16
+
+static unsigned
+bucket(uint64_t v)
+{
+     unsigned shift = 0;
+
+     while (v >> shift >= 2 * SUB) {
+          shift++;
+     }
+     if (shift * SUB + (v >> shift) >= LATENCY_BUCKETS) {
+          return LATENCY_BUCKETS - 1;
+     }
+     return shift * SUB + (v >> shift);
+}
+
+/* Return the middle of the range of values counted in bucket I. */
+static uint64_t
+value(unsigned i)
+{
+     unsigned shift = i < 2 * SUB ? 0 : i / SUB - 1;
+
+     return ((uint64_t) (i - shift * SUB) << shift) + (((uint64_t) 1 << shift) >> 1);
+}
+
+/* Count the latency V in histogram L. */
+void
+latency_record(struct Latency *l, uint64_t v)
+{
+     l->buckets[bucket(v)]++;
+     l->count++;
+     l->total += v;
+     if (v > l->max) {
+          l->max = v;
+     }
+}
+
+/* Return the latency that P percent of all values in L don't
+ * exceed, or 0 if L is empty. */
+uint64_t
+latency_percentile(const struct Latency *l, double p)
+{
+     uint64_t seen = 0, rank = l->count * p / 100;
+     unsigned i;
+
+     if (rank >= l->count) {
+          return l->max;
+     }
+     for (i = 0; i < LATENCY_BUCKETS; i++) {
+          seen += l->buckets[i];
+          if (seen > rank) {
+               return value(i) < l->max ? value(i) : l->max;
+          }
+     }
+     return l->max;
+}
+
+/* Print a summary of L to F, either as a JSON object, or as a line
+ * of columns with all times in milliseconds. */
+void
+latency_print(FILE *f, const struct Latency *l, bool json)
+{
+     static const double points[] = { 50, 90, 99, 99.9 };
+     unsigned i;
+
+     if (json) {
+          fprintf(f, "{\"count\": %llu, \"mean\": %llu",
+                  (unsigned long long) l->count,
+                  (unsigned long long) (l->count ? l->total / l->count : 0));
+          for (i = 0; i < sizeof(points) / sizeof(*points); i++) {
+               fprintf(f, ", \"p%g\": %llu", points[i],
+                       (unsigned long long) latency_percentile(l, points[i]));
+          }
+          fprintf(f, ", \"max\": %llu}", (unsigned long long) l->max);
+          return;
+     }
+
+     fprintf(f, "%8llu %10.3f", (unsigned long long) l->count,
+             l->count ? l->total / 1000.0 / l->count : 0);
+     for (i = 0; i < sizeof(points) / sizeof(*points); i++) {
+          fprintf(f, " %10.3f", latency_percentile(l, points[i]) / 1000.0);
+     }
+     fprintf(f, " %10.3f\n", l->max / 1000.0);
+}
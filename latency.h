@@ -0,0 +1,42 @@
+/* Copyright 2020-2021 Philip Kaludercic
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+/* Each power of two is split into 16 buckets, so that every recorded
+ * value is off by at most about 6%.  Values are measured in
+ * microseconds (see clock_now_us), and everything above 2^36 (about
+ * 19 hours) is counted in the last bucket. */
+#define LATENCY_BUCKETS (33 * 16)
+
+/* A histogram of latencies, see latency_record */
+struct Latency {
+     uint64_t count;
+     uint64_t total;
+     uint64_t max;
+     uint32_t buckets[LATENCY_BUCKETS];
+};
+
+void	 latency_record(struct Latency *, uint64_t);
+uint64_t latency_percentile(const struct Latency *, double);
+void	 latency_print(FILE *, const struct Latency *, bool);
+
+#endif
@@ -0,0 +1,534 @@
+/* Scriptable stand-in for a GTP engine
+ *
+ * Copyright 2020-2021 Philip Kaludercic
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gtp.h"
+#include "player.h"
+#include "server.h"
+
+/* expected by gtp.c */
+bool verbose;
+bool debug;
+char *komi;
+
+/* The mock answers every command sgo knows, after a configurable
+ * delay, so that sgo can be measured and tested without depending on
+ * the timing of a real engine.  Moves are taken from a script, or
+ * else chosen by the built-in player, and faults can be injected with
+ * a given probability.  All random decisions depend on the seed
+ * only. */
+
+#define COMMANDS (FINAL_SCORE + 1) /* last entry of enum Command */
+
+/* A delay in milliseconds, uniform between MIN and MAX, or
+ * exponentially distributed with mean MIN if EXPONENTIAL. */
+struct Latency {
+     double	 min, max;
+     bool	 exponential;
+};
+
+enum Fault {
+     NO_FAULT,
+     ERROR,                     /* "? invalid move" */
+     GARBAGE,                   /* output without a response prefix */
+     END,                       /* exit without answering */
+     HANG,                      /* never answer */
+};
+
+static const char *faults[] = {
+     [ERROR]	= "error",
+     [GARBAGE]	= "garbage",
+     [END]	= "eof",
+     [HANG]	= "hang",
+};
+
+static struct Latency latency[COMMANDS];
+static struct {
+     enum Fault	 fault;
+     double	 probability;
+} inject[COMMANDS];
+
+static bool unknown[COMMANDS];  /* commands the mock pretends not to know */
+static char **script;           /* scripted moves, NULL terminated */
+static unsigned candidates = 1; /* per analysis update */
+
+static struct Board *board;
+static bool quit;
+
+/* analysis in progress, see update */
+static bool streaming;
+static enum Command stream_cmd;
+static int interval;            /* in milliseconds */
+static unsigned long updates;
+
+static void
+usage(char *argv0)
+{
+     fprintf(stderr, "usage: %s -S [seed] -l [command=ms[-ms]|command=~ms] "
+             "-f [command=fault[:probability]] -m [move,...] -b [candidates] "
+             "-w [ms] -u [command]\n",
+             argv0);
+     exit(EXIT_FAILURE);
+}
+
+/* Return a uniformly distributed number in [0, 1). */
+static double
+uniform(void)
+{
+     return rand() / ((double) RAND_MAX + 1);
+}
+
+/* Split ARG at '=' and parse the command name, or "*" for every
+ * command.  Store the commands in FIRST and LAST, and return the text
+ * after the '='. */
+static char *
+commands(char *arg, enum Command *first, enum Command *last)
+{
+     char *value = strchr(arg, '=');
+
+     if (!value) {
+          return NULL;
+     }
+     *value++ = '\0';
+     if (!strcmp(arg, "*")) {
+          *first = 0;
+          *last = COMMANDS - 1;
+     } else if (gtp_command(arg, first)) {
+          *last = *first;
+     } else {
+          return NULL;
+     }
+     return value;
+}
+
+static bool
+parse_latency(char *arg)
+{
+     struct Latency l = {0};
+     enum Command c, last;
+     char *value, *end;
+
+     if (!(value = commands(arg, &c, &last))) {
+          return false;
+     }
+     if (*value == '~') {
+          l.exponential = true;
+          value++;
+     }
+     l.min = l.max = strtod(value, &end);
+     if (*end == '-' && !l.exponential) {
+          l.max = strtod(end + 1, &end);
+     }
+     if (*end || l.min < 0 || l.max < l.min) {
+          return false;
+     }
+
+     for (; c <= last; c++) {
+          latency[c] = l;
+     }
+     return true;
+}
+
+static bool
+parse_fault(char *arg)
+{
+     enum Command c, last;
+     enum Fault f;
+     char *value, *p, *end;
+     double probability = 1;
+
+     if (!(value = commands(arg, &c, &last))) {
+          return false;
+     }
+     if ((p = strchr(value, ':'))) {
+          *p++ = '\0';
+          probability = strtod(p, &end);
+          if (*end || probability < 0 || probability > 1) {
+               return false;
+          }
+     }
+     for (f = ERROR; f <= HANG; f++) {
+          if (!strcmp(value, faults[f])) {
+               break;
+          }
+     }
+     if (f > HANG) {
+          return false;
+     }
+
+     for (; c <= last; c++) {
+          inject[c].fault = f;
+          inject[c].probability = probability;
+     }
+     return true;
+}
+
+/* Split the comma separated list of moves ARG into the script. */
+static void
+parse_script(char *arg)
+{
+     size_t n = 1;
+     char *c, *save;
+
+     for (c = arg; *c; c++) {
+          n += *c == ',';
+     }
+     script = calloc(n + 1, sizeof(char *));
+     if (!script) {
+          perror("calloc");
+          exit(EXIT_FAILURE);
+     }
+     n = 0;
+     for (c = strtok_r(arg, ",", &save); c; c = strtok_r(NULL, ",", &save)) {
+          script[n++] = c;
+     }
+}
+
+/* Wait as long as configured for command C. */
+static void
+delay(enum Command c)
+{
+     struct Latency *l = &latency[c];
+     struct timespec ts;
+     double ms;
+
+     if (l->exponential) {
+          ms = -l->min * log(1 - uniform());
+     } else {
+          ms = l->min + (l->max - l->min) * uniform();
+     }
+     if (ms <= 0) {
+          return;
+     }
+
+     fflush(stdout);            /* earlier responses are not delayed */
+     ts.tv_sec = ms / 1000;
+     ts.tv_nsec = (ms - ts.tv_sec * 1000) * 1000000;
+     while (nanosleep(&ts, &ts) && errno == EINTR)
+          ;
+}
+
+static void
+respond(const char *id, bool success, const char *text)
+{
+     printf("%c%s%s%s\n\n", success ? '=' : '?', id, *text ? " " : "", text);
+}
+
+/* Inject a fault into the response to command C with the ID, and
+ * return true if no regular response should be sent. */
+static bool
+fault(const char *id, enum Command c)
+{
+     if (inject[c].fault == NO_FAULT || uniform() >= inject[c].probability) {
+          return false;
+     }
+
+     switch (inject[c].fault) {
+     case ERROR:
+          respond(id, false, "invalid move");
+          break;
+     case GARBAGE:
+          puts("mock engine malfunction\n");
+          break;
+     case END:
+          fflush(stdout);
+          exit(EXIT_FAILURE);
+     case HANG:
+          fflush(stdout);
+          for (;;) {
+               pause();
+          }
+     default:
+          abort();
+     }
+     return true;
+}
+
+/* Answer genmove for S by the next scripted move, or by the player if
+ * there is no script.  The move is played unless PEEK. */
+static void
+genmove(const char *id, enum Stone s, bool peek)
+{
+     static size_t next;
+     struct Vertex v = { .type = PASS };
+     char buf[7];
+
+     if (script) {
+          if (script[next]) {
+               if (!gtp_parse_vertex(board, script[next], &v)) {
+                    respond(id, true, script[next]); /* for testing */
+                    next += !peek;
+                    return;
+               }
+               next += !peek;
+          }
+     } else if (player_move(board, s, &v.coord)) {
+          v.type = VALID;
+     }
+
+     if (!peek && v.type == VALID && place_stone(board, s, v.coord) < 0) {
+          v.type = PASS;        /* the script didn't fit the game */
+     }
+     gtp_format_vertex(board, v, buf);
+     respond(id, true, buf);
+}
+
+/* Write the next analysis update of the running stream. */
+static void
+update(void)
+{
+     struct Vertex v = { .type = VALID };
+     char buf[7];
+     unsigned i;
+
+     updates++;
+     for (i = 0; i < candidates; i++) {
+          v.coord.x = rand() % board->width;
+          v.coord.y = rand() % board->height;
+          gtp_format_vertex(board, v, buf);
+          if (stream_cmd == KATA_ANALYZE) {
+               printf("%sinfo move %s visits %lu winrate %.4f prior %.4f order %u pv %s",
+                      i ? " " : "", buf, updates * (candidates - i),
+                      uniform(), uniform(), i, buf);
+          } else {
+               printf("%sinfo move %s visits %lu winrate %d prior %d order %u pv %s",
+                      i ? " " : "", buf, updates * (candidates - i),
+                      rand() % 10000, rand() % 10000, i, buf);
+          }
+     }
+     putchar('\n');
+     fflush(stdout);
+}
+
+static bool
+parse_color(const char *token, enum Stone *s)
+{
+     if (!strcasecmp(token, "b") || !strcasecmp(token, "black")) {
+          *s = BLACK;
+     } else if (!strcasecmp(token, "w") || !strcasecmp(token, "white")) {
+          *s = WHITE;
+     } else {
+          return false;
+     }
+     return true;
+}
+
+static void
+execute(char *line)
+{
+     char *id = "", *name, *args[4], *tok, *save;
+     char list[1024] = "";
+     enum Command c;
+     enum Stone s;
+     size_t n = 0;
+
+     if ((tok = strchr(line, '#'))) {
+          *tok = '\0';
+     }
+     if (!(tok = strtok_r(line, " ", &save))) {
+          return;
+     }
+     if (strspn(tok, "0123456789") == strlen(tok)) {
+          id = tok;
+          if (!(tok = strtok_r(NULL, " ", &save))) {
+               respond(id, false, "missing command");
+               return;
+          }
+     }
+     name = tok;
+     while (n < sizeof(args) / sizeof(*args) &&
+            (tok = strtok_r(NULL, " ", &save))) {
+          args[n++] = tok;
+     }
+
+     if (!gtp_command(name, &c) || unknown[c]) {
+          respond(id, false, "unknown command");
+          return;
+     }
+     delay(c);
+     if (fault(id, c) || board_command(&board, id, c, args, n)) {
+          return;
+     }
+
+     switch (c) {
+     case PROTOCOL_VERSION:
+          respond(id, true, "2");
+          break;
+     case NAME:
+          respond(id, true, "mock");
+          break;
+     case VERSION:
+          respond(id, true, "1");
+          break;
+     case KNOWN_COMMAND:
+          respond(id, true, n > 0 && gtp_command(args[0], &c) && !unknown[c]
+                  ? "true" : "false");
+          break;
+     case LIST_COMMANDS:
+          for (c = 0; c < COMMANDS; c++) {
+               if (!unknown[c]) {
+                    strcat(list, *list ? "\n" : "");
+                    strcat(list, gtp_command_name(c));
+               }
+          }
+          respond(id, true, list);
+          break;
+     case QUIT:
+          respond(id, true, "");
+          quit = true;
+          break;
+     case GENMOVE:
+     case REG_GENMOVE:
+          if (n < 1 || !parse_color(args[0], &s)) {
+               respond(id, false, "syntax error");
+               break;
+          }
+          genmove(id, s, c == REG_GENMOVE);
+          break;
+     case LZ_ANALYZE:
+     case KATA_ANALYZE:
+          /* the interval is given in centiseconds */
+          interval = n > 0 ? strtoul(args[n - 1], NULL, 10) * 10 : 0;
+          streaming = true;
+          stream_cmd = c;
+          updates = 0;
+          printf("=%s\n", id);
+          update();
+          break;
+     case FINAL_SCORE:
+          respond(id, true, "0");
+          break;
+     default:                   /* komi, time_settings, time_left */
+          respond(id, true, "");
+     }
+}
+
+int
+main(int argc, char *argv[])
+{
+     struct Reader r = {0};
+     struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+     struct timespec warmup = {0};
+     unsigned seed = 0, ms;
+     char *line;
+     size_t len;
+     ssize_t n;
+     int opt;
+
+     while ((opt = getopt(argc, argv, "S:l:f:m:b:w:u:")) != -1) {
+          switch (opt) {
+          case 'S':             /* random seed */
+               seed = strtoul(optarg, NULL, 10);
+               break;
+          case 'l':             /* latency */
+               if (!parse_latency(optarg)) {
+                    fprintf(stderr, "invalid latency \"%s\"\n", optarg);
+                    exit(EXIT_FAILURE);
+               }
+               break;
+          case 'f':             /* fault injection */
+               if (!parse_fault(optarg)) {
+                    fprintf(stderr, "invalid fault \"%s\"\n", optarg);
+                    exit(EXIT_FAILURE);
+               }
+               break;
+          case 'm':             /* scripted moves */
+               parse_script(optarg);
+               break;
+          case 'b':             /* bulk analysis output */
+               candidates = strtoul(optarg, NULL, 10);
+               if (!candidates) {
+                    usage(argv[0]);
+               }
+               break;
+          case 'w':             /* startup time, e.g. to load a network */
+               ms = strtoul(optarg, NULL, 10);
+               warmup.tv_sec = ms / 1000;
+               warmup.tv_nsec = ms % 1000 * 1000000L;
+               break;
+          case 'u': {           /* unsupported command */
+               enum Command c;
+
+               if (!gtp_command(optarg, &c)) {
+                    usage(argv[0]);
+               }
+               unknown[c] = true;
+          }
+               break;
+          default:
+               usage(argv[0]);
+          }
+     }
+     while (nanosleep(&warmup, &warmup) && errno == EINTR)
+          ;
+     srand(seed);
+     board = make_board(19, 19);
+
+     while (!quit) {
+          while (!quit && gtp_line(&r, &line, &len)) {
+               if (streaming) { /* any command ends the analysis */
+                    streaming = false;
+                    putchar('\n');
+               }
+               execute(line);
+          }
+          if (fflush(stdout) == EOF) {
+               perror("fflush");
+               exit(EXIT_FAILURE);
+          }
+          if (quit) {
+               break;
+          }
+
+          if (streaming) {
+               switch (poll(&pfd, 1, interval)) {
+               case -1:
+                    if (errno != EINTR) {
+                         perror("poll");
+                         exit(EXIT_FAILURE);
+                    }
+                    continue;
+               case 0:
+                    update();
+                    continue;
+               }
+          }
+
+          n = gtp_fill(&r, STDIN_FILENO);
+          if (n == 0) {
+               break;
+          }
+          if (n < 0 && errno != EINTR) {
+               perror("read");
+               exit(EXIT_FAILURE);
+          }
+     }
+
+     board_free(board);
+     free(r.buf);
+     return EXIT_SUCCESS;
+}
@@ -0,0 +1,125 @@
+/* Built-in player
+ *
+ * Copyright 2020-2021 Philip Kaludercic
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+
+#include "player.h"
+
+/* The player doesn't attempt to play well, but only to play legal
+ * moves quickly, so that games end: It picks a random move among all
+ * valid ones, except for those that would fill one of its own eyes,
+ * and passes if there are none left.  The sequence of random numbers
+ * is always the same, so that games can be reproduced. */
+
+static uint64_t state = 0x9e3779b97f4a7c15;
+
+/* xorshift64, see Marsaglia, "Xorshift RNGs" (2003) */
+static uint64_t
+next_random(void)
+{
+     state ^= state << 13;
+     state ^= state >> 7;
+     state ^= state << 17;
+     return state;
+}
+
+/* Check if C on board B is surrounded by stones of colour S only. */
+static bool
+eye(struct Board *b, enum Stone s, struct Coord c)
+{
+     if (c.x > 0 && stone_at(b, C(c.x - 1, c.y)) != s) {
+          return false;
+     }
+     if (c.x + 1 < b->width && stone_at(b, C(c.x + 1, c.y)) != s) {
+          return false;
+     }
+     if (c.y > 0 && stone_at(b, C(c.x, c.y - 1)) != s) {
+          return false;
+     }
+     if (c.y + 1 < b->height && stone_at(b, C(c.x, c.y + 1)) != s) {
+          return false;
+     }
+     return true;
+}
+
+/* Choose a move for S on board B, and store it in MOVE.  Return false
+ * if S should pass. */
+bool
+player_move(struct Board *b, enum Stone s, struct Coord *move)
+{
+     uint16_t n = b->width * b->height, i, start;
+
+     /* walk the board from a random point, instead of collecting
+      * all valid moves first */
+     start = next_random() % n;
+     for (i = 0; i < n; i++) {
+          struct Coord c = P(b, (start + i) % n);
+
+          if (stone_at(b, c) == NONE && !eye(b, s, c) &&
+              valid_move(b, s, c)) {
+               *move = c;
+               return true;
+          }
+     }
+     return false;
+}
+
+/* Count the empty points next to C on board B. */
+static unsigned
+liberties(struct Board *b, struct Coord c)
+{
+     return (c.x > 0 && stone_at(b, C(c.x - 1, c.y)) == NONE) +
+          (c.x + 1 < b->width && stone_at(b, C(c.x + 1, c.y)) == NONE) +
+          (c.y > 0 && stone_at(b, C(c.x, c.y - 1)) == NONE) +
+          (c.y + 1 < b->height && stone_at(b, C(c.x, c.y + 1)) == NONE);
+}
+
+/* Guess where S will play on board B, assuming that S answers the
+ * last move locally, and store it in MOVE.  Return false if there is
+ * no guess. */
+bool
+player_guess(struct Board *b, enum Stone s, struct Coord *move)
+{
+     struct Move *m = b->history;
+     unsigned best = 0, l;
+     int dx, dy;
+
+     if (!m->before || m->setup || m->pass) {
+          return false;
+     }
+     for (dx = -1; dx <= 1; dx++) {
+          for (dy = -1; dy <= 1; dy++) {
+               struct Coord c = C(m->placed.x + dx, m->placed.y + dy);
+
+               if ((dx == 0 && dy == 0) ||
+                   m->placed.x + dx < 0 || c.x >= b->width ||
+                   m->placed.y + dy < 0 || c.y >= b->height ||
+                   stone_at(b, c) != NONE || !valid_move(b, s, c)) {
+                    continue;
+               }
+               /* prefer open points, and contact over diagonal moves
+                * if they are as open */
+               l = 2 * liberties(b, c) + (dx == 0 || dy == 0);
+               if (l > best) {
+                    best = l;
+                    *move = c;
+               }
+          }
+     }
+     return best > 0;
+}
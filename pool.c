@@ -0,0 +1,409 @@
+/* Pool of warm engines
+ *
+ * Copyright 2020-2021 Philip Kaludercic
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "clock.h"
+#include "engine.h"
+#include "gtp.h"
+#include "pool.h"
+
+extern bool verbose;
+
+/* Engines that take long to start (e.g. to load a neural network)
+ * are kept running by sgo, and lent to other instances of sgo that
+ * connect to the pool, one engine per connection.  A connection is
+ * passed through to its engine unchanged, and the instance of sgo on
+ * the other end prepares the engine for its game just like any other
+ * (see gtp_init).  Once the connection is closed, the engine's board
+ * is cleared, and it is lent to the next connection.  Engines that
+ * are not lent are checked regularly, and replaced if they don't
+ * respond. */
+
+/* ms to wait for an engine to start, or to finish what it was doing
+ * when it was returned */
+#define STARTUP_TIMEOUT (60 * 1000)
+
+/* ms between and to wait for the answer to checks of idle engines */
+#define CHECK_INTERVAL (30 * 1000)
+#define CHECK_TIMEOUT (10 * 1000)
+
+/* Data passed through in one direction */
+struct Pipe {
+     char	 buf[BUFSIZ];
+     size_t	 start, end;
+};
+
+static struct Worker {
+     struct Engine engine;
+     enum {
+          BROKEN,               /* couldn't be started */
+          WAITING,              /* for the response to command TOKEN */
+          IDLE,
+          LENT,                 /* to the connection CLIENT */
+     } state;
+     unsigned token;
+     uint64_t deadline;         /* for the state to change */
+     struct Reader input;       /* responses while not lent */
+     int client;
+     struct Pipe up, down;      /* client to engine, and back */
+} *workers;
+static unsigned nworkers;
+
+/* poll entries per worker: the engine's output, input, standard
+ * error and the client */
+#define FDS 4
+
+/* Send the command CMD to the engine of W, and wait up to TIMEOUT ms
+ * for the answer. */
+static void
+ask(struct Worker *w, const char *cmd, uint64_t timeout)
+{
+     /* a command the client didn't finish is ended first */
+     dprintf(w->engine.out, "\n%u %s\n", ++w->token, cmd);
+     w->state = WAITING;
+     w->deadline = clock_now() + timeout;
+}
+
+/* Release the connection of W, if it has one. */
+static void
+hang_up(struct Worker *w)
+{
+     if (w->client >= 0) {
+          close(w->client);
+          w->client = -1;
+     }
+     w->up.start = w->up.end = 0;
+     w->down.start = w->down.end = 0;
+}
+
+/* (Re)start the engine of W. */
+static void
+start(struct Worker *w)
+{
+     hang_up(w);
+     engine_stop(&w->engine);    /* collected by engine_reap */
+     w->input.start = w->input.end = w->input.scan = 0;
+
+     if (!engine_spawn(&w->engine)) {
+          w->state = BROKEN;
+          w->deadline = clock_now() + CHECK_INTERVAL;
+          return;
+     }
+     ask(w, "protocol_version", STARTUP_TIMEOUT);
+}
+
+/* Read into P from FD, unless P still holds data that hasn't been
+ * passed on.  Return false if FD was closed. */
+static bool
+fill(struct Pipe *p, int fd)
+{
+     ssize_t n;
+
+     if (p->end) {
+          return true;
+     }
+     n = read(fd, p->buf, sizeof(p->buf));
+     if (n > 0) {
+          p->start = 0;
+          p->end = n;
+     }
+     return n > 0 || (n < 0 && (errno == EAGAIN || errno == EINTR));
+}
+
+/* Write as much of P to FD as possible.  Return false if FD was
+ * closed. */
+static bool
+drain(struct Pipe *p, int fd)
+{
+     ssize_t n = write(fd, p->buf + p->start, p->end - p->start);
+
+     if (n < 0) {
+          return errno == EAGAIN || errno == EINTR;
+     }
+     p->start += n;
+     if (p->start == p->end) {
+          p->start = p->end = 0;
+     }
+     return true;
+}
+
+/* Handle output of the engine of W, while it isn't lent.  Return
+ * false if the engine exited. */
+static bool
+listen_to(struct Worker *w)
+{
+     struct Response r;
+     ssize_t n;
+
+     n = gtp_fill(&w->input, w->engine.in);
+     if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+          return false;
+     }
+     while (gtp_next(&w->input, &r)) {
+          if (w->state == WAITING && r.id == (int64_t) w->token) {
+               if (verbose) {
+                    fprintf(stderr, "engine %u is idle\n",
+                            (unsigned) (w - workers));
+               }
+               w->state = IDLE;
+               w->deadline = clock_now() + CHECK_INTERVAL;
+          }
+     }
+     return true;
+}
+
+/* Lend an idle engine to the connection CLIENT.  Return false if no
+ * engine is idle. */
+static bool
+lend(int client)
+{
+     struct Worker *w;
+     int one = 1;
+
+     for (w = workers; w < workers + nworkers; w++) {
+          if (w->state == IDLE) {
+               break;
+          }
+     }
+     if (w == workers + nworkers) {
+          return false;
+     }
+
+     if (fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK) < 0) {
+          perror("fcntl");
+          close(client);
+          return true;
+     }
+     setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+     w->client = client;
+     w->state = LENT;
+     if (verbose) {
+          fprintf(stderr, "engine %u lent\n", (unsigned) (w - workers));
+     }
+     return true;
+}
+
+/* Handle the events poll reported in FDS for worker W. */
+static void
+events(struct Worker *w, struct pollfd *fds)
+{
+     struct Engine *e = &w->engine;
+     bool ok = true;
+
+     if (fds[2].revents && e->err >= 0) {
+          engine_stderr(e);
+     }
+
+     if (w->state != LENT) {
+          if (fds[0].revents && !listen_to(w)) {
+               fprintf(stderr, "engine %u exited\n", (unsigned) (w - workers));
+               start(w);
+          }
+          return;
+     }
+
+     /* pass on what is buffered before looking at hangups, so that
+      * nothing either side sent before hanging up is lost */
+     if (fds[3].revents & POLLOUT) {
+          ok &= drain(&w->down, w->client);
+     }
+     if (fds[1].revents && !drain(&w->up, e->out)) {
+          goto exited;
+     }
+     if (ok && fds[3].revents & (POLLIN | POLLHUP | POLLERR)) {
+          ok &= fill(&w->up, w->client);
+     }
+     if (!ok) {                 /* the client is done */
+          if (verbose) {
+               fprintf(stderr, "engine %u returned\n", (unsigned) (w - workers));
+          }
+          hang_up(w);
+          ask(w, "clear_board", STARTUP_TIMEOUT);
+          return;
+     }
+     if (fds[0].revents && !fill(&w->down, e->in)) {
+          goto exited;
+     }
+     return;
+
+exited:
+     fprintf(stderr, "engine %u exited\n", (unsigned) (w - workers));
+     start(w);
+}
+
+/* Check if worker W ran out of time at T. */
+static void
+timeouts(struct Worker *w, uint64_t t)
+{
+     if (w->state == LENT || t < w->deadline) {
+          return;
+     }
+
+     switch (w->state) {
+     case IDLE:
+          ask(w, "protocol_version", CHECK_TIMEOUT);
+          break;
+     case WAITING:
+          fprintf(stderr, "engine %u stopped responding\n",
+                  (unsigned) (w - workers));
+          /* fallthrough */
+     case BROKEN:
+          start(w);
+          break;
+     default:
+          ;
+     }
+}
+
+/* Keep N engines started by the command line CMD running, and lend
+ * them to connections on ADDRESS (see engine_address).
+ *
+ * Returns the exit status of sgo. */
+int
+pool(const char *address, const char *cmd, unsigned n)
+{
+     struct pollfd *fds;
+     struct Worker *w;
+     uint64_t t, next;
+     int sock, client, r;
+     char **argv;
+     unsigned i;
+
+     assert(n > 0);
+
+     if (!engine_address(address)) {
+          fprintf(stderr, "%s: not an address\n", address);
+          return EXIT_FAILURE;
+     }
+     sock = engine_listen(address);
+     if (sock < 0) {
+          return EXIT_FAILURE;
+     }
+
+     nworkers = n;
+     workers = calloc(n, sizeof(struct Worker));
+     fds = calloc(1 + n * FDS, sizeof(struct pollfd));
+     if (!workers || !fds) {
+          perror("calloc");
+          exit(EXIT_FAILURE);
+     }
+     for (w = workers; w < workers + n; w++) {
+          if (!(argv = engine_parse(cmd))) {
+               fputs("cannot parse engine command\n", stderr);
+               return EXIT_FAILURE;
+          }
+          w->engine.argv = argv;
+          w->engine.in = w->engine.out = w->engine.err = -1;
+          w->client = -1;
+          start(w);
+     }
+
+     for (;;) {
+          /* connections wait in the backlog until an engine is idle */
+          fds[0].fd = sock;
+          fds[0].events = POLLIN;
+          for (w = workers; w < workers + n; w++) {
+               if (w->state == IDLE) {
+                    break;
+               }
+          }
+          if (w == workers + n) {
+               fds[0].fd = -1;
+          }
+
+          next = UINT64_MAX;
+          t = clock_now();
+          for (i = 0; i < n; i++) {
+               struct pollfd *f = fds + 1 + i * FDS;
+
+               w = &workers[i];
+               memset(f, 0, FDS * sizeof(struct pollfd));
+               f[0].fd = w->engine.in;
+               f[1].fd = -1;
+               f[2].fd = w->engine.err;
+               f[3].fd = w->client;
+               f[2].events = POLLIN;
+               if (w->state == LENT) {
+                    /* only read more once everything was passed on.
+                     * Descriptors without events are left out, as a
+                     * hangup can't be handled before that either. */
+                    f[0].events = w->down.end ? 0 : POLLIN;
+                    f[1].fd = w->engine.out;
+                    f[1].events = w->up.end ? POLLOUT : 0;
+                    f[3].events = (w->up.end ? 0 : POLLIN) |
+                         (w->down.end ? POLLOUT : 0);
+                    if (!f[0].events) {
+                         f[0].fd = -1;
+                    }
+                    if (!f[1].events) {
+                         f[1].fd = -1;
+                    }
+                    if (!f[3].events) {
+                         f[3].fd = -1;
+                    }
+               } else {
+                    f[0].events = POLLIN;
+                    if (w->deadline < next) {
+                         next = w->deadline;
+                    }
+               }
+          }
+          r = engine_reap();
+          if (r >= 0 && t + r < next) {
+               next = t + r;
+          }
+
+          if (poll(fds, 1 + n * FDS,
+                   next == UINT64_MAX ? -1 : next <= t ? 0 : (int) (next - t)) < 0) {
+               if (errno == EINTR) {
+                    continue;
+               }
+               perror("poll");
+               exit(EXIT_FAILURE);
+          }
+
+          if (fds[0].revents & POLLIN) {
+               client = accept(sock, NULL, NULL);
+               if (client < 0) {
+                    if (errno != EAGAIN && errno != EINTR) {
+                         perror("accept");
+                    }
+               } else if (!lend(client)) {
+                    close(client);
+               }
+          }
+          t = clock_now();
+          for (i = 0; i < n; i++) {
+               events(&workers[i], fds + 1 + i * FDS);
+               timeouts(&workers[i], t);
+          }
+     }
+}
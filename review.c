@@ -0,0 +1,346 @@
+/* Headless review of a finished game
+ *
+ * Copyright 2020-2021 Philip Kaludercic
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "board.h"
+#include "clock.h"
+#include "gtp.h"
+#include "review.h"
+
+extern bool verbose;
+
+/* Every position of the game is analysed until the engine has spent
+ * a number of visits on it.  The game is split into as many segments
+ * as engines are started, and every engine is brought to the start
+ * of its segment at once, before it works its way through the
+ * segment move by move, just like the analysis engine follows the
+ * game in the user interface. */
+static struct Reviewer {
+     struct Board *b;
+     struct Gtp *engine;
+     size_t at, end;            /* position analysed, end of the segment */
+     uint64_t since;            /* when the analysis of AT started */
+} *reviewers;
+static unsigned nreviewers;
+
+/* The moves of the game, and the results for the position before
+ * every move and after the last one */
+static struct Step {
+     enum Stone player;
+     struct Coord placed;
+     bool pass;
+} *moves;
+static struct Result {
+     bool done;
+     bool known;                /* false if the engine gave up */
+     uint16_t winrate;          /* for black, in 1/10000 */
+     struct Coord best;
+} *results;
+static size_t nmoves;
+
+/* centiseconds between analysis updates */
+#define INTERVAL 10
+
+/* ms to wait for an engine to reach the visits of a position */
+#define POSITION_TIMEOUT (60 * 1000)
+
+/* loss in winrate of a move, in 1/10000, to count as a blunder */
+#define BLUNDER 1000
+
+/* Return the colour to move in position I. */
+static enum Stone
+to_move(size_t i)
+{
+     if (i < nmoves) {
+          return moves[i].player;
+     }
+     return nmoves ? opposite(moves[nmoves - 1].player) : BLACK;
+}
+
+/* Play move I on the board of R, and tell its engine. */
+static void
+advance(struct Reviewer *r, size_t i)
+{
+     if (moves[i].pass) {
+          gtp_pass(r->b, moves[i].player);
+     } else {
+          gtp_place_stone(r->b, moves[i].player, moves[i].placed);
+     }
+}
+
+/* Record the analysis A of the current position of R, and go on to
+ * the next one.  A is NULL if the engine gave up. */
+static void
+record(struct Reviewer *r, const struct Analysis *a)
+{
+     struct Result *res = &results[r->at];
+     unsigned i, n = r->b->width * r->b->height;
+
+     res->done = true;
+     for (i = 0; a && i < n; i++) {
+          if (a->move[i].visits && a->move[i].order == 0) {
+               res->known = true;
+               res->winrate = to_move(r->at) == BLACK
+                    ? a->move[i].winrate
+                    : 10000 - a->move[i].winrate;
+               res->best = P(r->b, i);
+          }
+     }
+     if (verbose) {
+          fprintf(stderr, "position %zu: %s\n", r->at,
+                  res->known ? "done" : "unknown");
+     }
+
+     if (++r->at < r->end) {
+          advance(r, r->at - 1);
+          r->since = clock_now();
+     } else {
+          gtp_interrupt(r->engine);
+     }
+}
+
+/* Check if the analysis of R has reached VISITS. */
+static void
+check(struct Reviewer *r, unsigned visits, uint64_t t)
+{
+     const struct Analysis *a;
+
+     if (r->at >= r->end) {
+          return;
+     }
+     a = gtp_analysis(r->b);
+     if (a && a->visits >= visits) {
+          record(r, a);
+     } else if (t - r->since > POSITION_TIMEOUT) {
+          fprintf(stderr, "position %zu: no answer from %s\n",
+                  r->at, gtp_name(r->engine));
+          record(r, NULL);
+     }
+}
+
+/* Write C on board B, or pass, to F. */
+static void
+vertex(FILE *f, struct Board *b, bool pass, struct Coord c)
+{
+     char buf[7];
+
+     gtp_format_vertex(b, (struct Vertex) { pass ? PASS : VALID, c }, buf);
+     fprintf(f, "%-4s", buf);
+}
+
+/* Write the winrate of black after every move as a bar graph, and
+ * the moves that lost the most to F. */
+static void
+report(FILE *f, struct Board *b)
+{
+     size_t i, j, *order, nblunders = 0;
+     int *loss;
+
+     loss = calloc(nmoves + 1, sizeof(int));
+     order = calloc(nmoves + 1, sizeof(size_t));
+     if (!loss || !order) {
+          perror("calloc");
+          exit(EXIT_FAILURE);
+     }
+
+     fputs("move       black winrate\n", f);
+     for (i = 0; i <= nmoves; i++) {
+          unsigned bar = results[i].winrate * 50 / 10000;
+
+          fprintf(f, "%4zu ", i);
+          if (i == 0) {
+               fputs("      ", f);
+          } else {
+               fprintf(f, "%c ", moves[i - 1].player == BLACK ? 'B' : 'W');
+               vertex(f, b, moves[i - 1].pass, moves[i - 1].placed);
+          }
+          if (!results[i].known) {
+               fputs("     ?\n", f);
+               continue;
+          }
+          fprintf(f, "%5.1f%% |", results[i].winrate / 100.0);
+          for (j = 0; j < 50; j++) {
+               fputc(j < bar ? '#' : j == 25 ? '|' : ' ', f);
+          }
+          fputs("|\n", f);
+     }
+
+     /* a move loses what the position before was worth to its
+      * player, minus what the position after it is worth */
+     for (i = 0; i < nmoves; i++) {
+          if (!results[i].known || !results[i + 1].known) {
+               continue;
+          }
+          loss[i] = results[i].winrate - results[i + 1].winrate;
+          if (moves[i].player == WHITE) {
+               loss[i] = -loss[i];
+          }
+          if (loss[i] < BLUNDER) {
+               continue;
+          }
+          for (j = nblunders++; j > 0 && loss[order[j - 1]] < loss[i]; j--) {
+               order[j] = order[j - 1];
+          }
+          order[j] = i;
+     }
+
+     fprintf(f, "\n%zu blunders\n", nblunders);
+     for (j = 0; j < nblunders; j++) {
+          i = order[j];
+          fprintf(f, "%4zu %c ", i + 1, moves[i].player == BLACK ? 'B' : 'W');
+          vertex(f, b, moves[i].pass, moves[i].placed);
+          fprintf(f, " -%4.1f%%, best ", loss[i] / 100.0);
+          vertex(f, b, false, results[i].best);
+          fputs("\n", f);
+     }
+
+     free(loss);
+     free(order);
+}
+
+/* Review the game leading to the current position on board B with
+ * PARALLEL instances (or one per processor, if 0) of the analysis
+ * engine started by the command line ENGINE, spending VISITS on every
+ * position.  The results are written to standard output.
+ *
+ * Returns the exit status of sgo. */
+int
+review(struct Board *b, const char *engine, unsigned parallel, unsigned visits)
+{
+     struct Move *m;
+     struct pollfd *fds;
+     size_t nfds, done = 0, i, j, per;
+     uint64_t begin, t;
+     int timeout;
+
+     for (m = b->history, nmoves = 0; m; m = m->before) {
+          nmoves += !m->setup;
+     }
+     moves = calloc(nmoves ? nmoves : 1, sizeof(struct Step));
+     results = calloc(nmoves + 1, sizeof(struct Result));
+     if (!moves || !results) {
+          perror("calloc");
+          exit(EXIT_FAILURE);
+     }
+     for (m = b->history, i = nmoves; m; m = m->before) {
+          if (!m->setup) {
+               i--;
+               moves[i].player = m->player;
+               moves[i].placed = m->placed;
+               moves[i].pass = m->pass;
+          }
+     }
+
+     if (parallel == 0) {
+          long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+          parallel = cpus > 0 ? cpus : 1;
+     }
+     if (parallel > nmoves + 1) {
+          parallel = nmoves + 1;
+     }
+     if (parallel > GTP_ENGINES) {
+          parallel = GTP_ENGINES;
+     }
+
+     nreviewers = parallel;
+     reviewers = calloc(nreviewers, sizeof(struct Reviewer));
+     fds = calloc(nreviewers * GTP_FDS, sizeof(struct pollfd));
+     if (!reviewers || !fds) {
+          perror("calloc");
+          exit(EXIT_FAILURE);
+     }
+
+     /* every engine replays the moves up to its segment in one go */
+     begin = clock_now();
+     per = (nmoves + 1 + nreviewers - 1) / nreviewers;
+     gtp_batch_begin();
+     for (i = 0; i < nreviewers; i++) {
+          struct Reviewer *r = &reviewers[i];
+
+          r->at = i * per;
+          r->end = r->at + per > nmoves + 1 ? nmoves + 1 : r->at + per;
+          r->b = make_board(b->height, b->width);
+          for (j = 0; j < r->at; j++) {
+               if (moves[j].pass) {
+                    pass(r->b, moves[j].player);
+               } else {
+                    place_stone(r->b, moves[j].player, moves[j].placed);
+               }
+          }
+          r->engine = gtp_open(r->b, engine);
+          if (!r->engine) {
+               fputs("cannot parse analysis engine command\n", stderr);
+               return EXIT_FAILURE;
+          }
+          gtp_sync(r->b);
+          gtp_analyze(r->engine, LZ_ANALYZE, INTERVAL);
+          r->since = clock_now();
+     }
+     gtp_batch_end();
+
+     while (done <= nmoves) {
+          if (gtp_pending()) {
+               gtp_check_responses();
+          } else {
+               /* wake up regularly to notice engines that hang */
+               timeout = gtp_timeout();
+               if (timeout < 0 || timeout > 1000) {
+                    timeout = 1000;
+               }
+               nfds = gtp_fds(fds, nreviewers * GTP_FDS);
+               if (poll(fds, nfds, timeout) < 0) {
+                    if (errno == EINTR) {
+                         continue;
+                    }
+                    perror("poll");
+                    exit(EXIT_FAILURE);
+               }
+               gtp_events(fds, nfds);
+          }
+
+          t = clock_now();
+          for (i = 0; i < nreviewers; i++) {
+               check(&reviewers[i], visits, t);
+          }
+          for (done = 0, i = 0; i <= nmoves; i++) {
+               done += results[i].done;
+          }
+     }
+
+     report(stdout, b);
+     fprintf(stderr, "%zu positions, %.1f seconds with %u engines\n",
+             nmoves + 1, (clock_now() - begin) / 1000.0, nreviewers);
+
+     gtp_quit();
+     for (i = 0; i < nreviewers; i++) {
+          board_free(reviewers[i].b);
+     }
+     free(reviewers);
+     free(fds);
+     free(moves);
+     free(results);
+
+     return EXIT_SUCCESS;
+}
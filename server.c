@@ -0,0 +1,318 @@
+/* GTP engine mode
+ *
+ * Copyright 2020-2021 Philip Kaludercic
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "board.h"
+#include "gtp.h"
+#include "player.h"
+#include "server.h"
+
+#define LENGTH(a) (sizeof(a)/sizeof(*a))
+
+extern char *komi;
+
+/* sgo can also act as an engine itself, reading commands from its
+ * standard input, and answering on its standard output.  Moves are
+ * checked against the board, so that sgo can be used as a referee,
+ * and generated by the built-in player (see player.c).  Responses
+ * are only written out once all commands that have been read are
+ * handled, so that a client sending many commands at once is
+ * answered with few system calls. */
+
+static const enum Command supported[] = {
+     PROTOCOL_VERSION, NAME, VERSION, KNOWN_COMMAND, LIST_COMMANDS,
+     QUIT, BOARDSIZE, CLEAR_BOARD, KOMI, PLAY, GENMOVE, REG_GENMOVE,
+     UNDO, FINAL_SCORE, TIME_SETTINGS, TIME_LEFT,
+};
+
+static struct Board *board;
+static double komi_value;
+static bool quit;
+
+/* Check if the command NAME is supported, and store it in C. */
+static bool
+lookup(const char *name, enum Command *c)
+{
+     unsigned i;
+
+     if (!gtp_command(name, c)) {
+          return false;
+     }
+     for (i = 0; i < LENGTH(supported); i++) {
+          if (supported[i] == *c) {
+               return true;
+          }
+     }
+     return false;
+}
+
+static bool
+parse_color(const char *token, enum Stone *s)
+{
+     if (!strcasecmp(token, "b") || !strcasecmp(token, "black")) {
+          *s = BLACK;
+     } else if (!strcasecmp(token, "w") || !strcasecmp(token, "white")) {
+          *s = WHITE;
+     } else {
+          return false;
+     }
+     return true;
+}
+
+/* Answer the command with the ID (possibly empty), either
+ * successfully or with an error message. */
+static void
+respond(const char *id, bool success, const char *fmt, ...)
+{
+     va_list ap;
+
+     putchar(success ? '=' : '?');
+     fputs(id, stdout);
+     if (*fmt) {
+          putchar(' ');
+          va_start(ap, fmt);
+          vprintf(fmt, ap);
+          va_end(ap);
+     }
+     fputs("\n\n", stdout);
+}
+
+/* Generate a move for S, and play it unless PEEK. */
+static void
+genmove(const char *id, enum Stone s, bool peek)
+{
+     struct Vertex v = { .type = PASS };
+     char buf[7];
+
+     if (player_move(board, s, &v.coord)) {
+          v.type = VALID;
+     }
+     if (!peek) {
+          if (v.type == VALID) {
+               place_stone(board, s, v.coord);
+          } else {
+               pass(board, s);
+          }
+     }
+
+     gtp_format_vertex(board, v, buf);
+     respond(id, true, "%s", buf);
+}
+
+/* Handle C with the ID and the N ARGS if it changes the position on
+ * *BOARD (boardsize, clear_board, play or undo), and return false for
+ * any other command.  Shared with mock-gtp.c. */
+bool
+board_command(struct Board **board, const char *id, enum Command c,
+              char *args[], size_t n)
+{
+     struct Board *fresh;
+     unsigned long size;
+     struct Vertex v;
+     enum Stone s;
+     char *end;
+
+     switch (c) {
+     case BOARDSIZE:
+          size = n > 0 ? strtoul(args[0], &end, 10) : 0;
+          if (size < 2 || *end || size > 25 ||
+              !(fresh = make_board(size, size))) {
+               respond(id, false, "unacceptable size");
+               return true;
+          }
+          break;
+     case CLEAR_BOARD:
+          size = (*board)->width;
+          if (!(fresh = make_board(size, size))) {
+               respond(id, false, "cannot clear board");
+               return true;
+          }
+          break;
+     case PLAY:
+          if (n < 2 || !parse_color(args[0], &s) ||
+              !gtp_parse_vertex(*board, args[1], &v) || v.type == RESIGN) {
+               respond(id, false, "syntax error");
+          } else if (v.type == PASS) {
+               pass(*board, s);
+               respond(id, true, "");
+          } else if (place_stone(*board, s, v.coord) < 0) {
+               respond(id, false, "illegal move");
+          } else {
+               respond(id, true, "");
+          }
+          return true;
+     case UNDO:
+          if (!undo_move(*board)) {
+               respond(id, false, "cannot undo");
+          } else {
+               respond(id, true, "");
+          }
+          return true;
+     default:
+          return false;
+     }
+
+     board_free(*board);
+     *board = fresh;
+     respond(id, true, "");
+     return true;
+}
+
+/* Execute the command LINE, with all control characters removed. */
+static void
+execute(char *line)
+{
+     char *id = "", *name, *args[4], *tok, *save, *end;
+     char list[512] = "";
+     enum Command c;
+     enum Stone s;
+     double score;
+     size_t n = 0;
+     unsigned i;
+
+     if ((tok = strchr(line, '#'))) {
+          *tok = '\0';          /* comment */
+     }
+     if (!(tok = strtok_r(line, " ", &save))) {
+          return;               /* empty line */
+     }
+     if (strspn(tok, "0123456789") == strlen(tok)) {
+          id = tok;
+          if (!(tok = strtok_r(NULL, " ", &save))) {
+               respond(id, false, "missing command");
+               return;
+          }
+     }
+     name = tok;
+     while (n < LENGTH(args) && (tok = strtok_r(NULL, " ", &save))) {
+          args[n++] = tok;
+     }
+
+     if (!lookup(name, &c)) {
+          respond(id, false, "unknown command");
+          return;
+     }
+     if (board_command(&board, id, c, args, n)) {
+          return;
+     }
+
+     switch (c) {
+     case PROTOCOL_VERSION:
+          respond(id, true, "2");
+          break;
+     case NAME:
+          respond(id, true, "sgo");
+          break;
+     case VERSION:
+          respond(id, true, "");
+          break;
+     case KNOWN_COMMAND:
+          respond(id, true, n > 0 && lookup(args[0], &c) ? "true" : "false");
+          break;
+     case LIST_COMMANDS:
+          for (i = 0; i < LENGTH(supported); i++) {
+               strcat(list, gtp_command_name(supported[i]));
+               strcat(list, i + 1 < LENGTH(supported) ? "\n" : "");
+          }
+          respond(id, true, "%s", list);
+          break;
+     case QUIT:
+          respond(id, true, "");
+          quit = true;
+          break;
+     case KOMI:
+          if (n < 1 || (komi_value = strtod(args[0], &end), *end)) {
+               respond(id, false, "syntax error");
+               break;
+          }
+          respond(id, true, "");
+          break;
+     case GENMOVE:
+     case REG_GENMOVE:
+          if (n < 1 || !parse_color(args[0], &s)) {
+               respond(id, false, "syntax error");
+               break;
+          }
+          genmove(id, s, c == REG_GENMOVE);
+          break;
+     case FINAL_SCORE:
+          score = player_points(board, BLACK) - player_points(board, WHITE)
+               - komi_value;
+          if (score > 0) {
+               respond(id, true, "B+%g", score);
+          } else if (score < 0) {
+               respond(id, true, "W+%g", -score);
+          } else {
+               respond(id, true, "0");
+          }
+          break;
+     case TIME_SETTINGS:
+     case TIME_LEFT:
+          respond(id, true, "");        /* the player is fast enough */
+          break;
+     default:
+          respond(id, false, "unknown command");
+     }
+}
+
+/* Act as a GTP engine playing on a board of SIZE until the command
+ * "quit" is received, or the input ends. */
+int
+serve(uint8_t size)
+{
+     struct Reader r = {0};
+     char *line;
+     size_t len;
+     ssize_t n;
+
+     board = make_board(size, size);
+     komi_value = komi ? strtod(komi, NULL) : 0;
+
+     while (!quit) {
+          while (!quit && gtp_line(&r, &line, &len)) {
+               execute(line);
+          }
+          if (fflush(stdout) == EOF) {
+               perror("fflush");
+               return EXIT_FAILURE;
+          }
+          if (quit) {
+               break;
+          }
+
+          n = gtp_fill(&r, STDIN_FILENO);
+          if (n == 0) {
+               break;
+          }
+          if (n < 0 && errno != EINTR) {
+               perror("read");
+               return EXIT_FAILURE;
+          }
+     }
+
+     board_free(board);
+     free(r.buf);
+     return EXIT_SUCCESS;
+}
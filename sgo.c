@@ -26,8 +26,17 @@
 #include <string.h>
 
 #include "board.h"
+#include "cache.h"
+#include "clock.h"
 #include "gtp.h"
+#include "history.h"
+#include "journal.h"
+#include "player.h"
+#include "pool.h"
+#include "review.h"
+#include "server.h"
 #include "state.h"
+#include "tournament.h"
 #include "ui.h"
 
 
@@ -38,14 +47,28 @@
 
 #define MARGIN 16
 
+/* ms to wait for an engine after its time has run out */
+#define GRACE 1000
+
+/* centiseconds between analysis updates */
+#define ANALYSIS_INTERVAL 10
+
 
 
-static enum Stone self;
+static enum Stone self = BLACK;
 static struct Board *active_board;
 static enum State state = QUERY_BLACK;
 static bool manual;
+static bool engine;             /* act as an engine, see server.c */
+static bool pondering;          /* see ponder */
+static struct Gtp *players[3];  /* engines playing each colour */
+static uint32_t requested[3];   /* pending move requests, or 0 */
+static struct Gtp *analyst;
+static enum { NO_LATENCY, TEXT, JSON } latency;
+static struct Clock game_clock, *timed; /* NULL without a time control */
 bool verbose;
 bool debug;
+char *komi;
 
 
 
@@ -53,16 +76,144 @@ __attribute__ ((noreturn))
 static void
 usage(char *argv0)
 {
-     fprintf(stderr, "usage: %s -m -s [WxH]\n", argv0);
+     fprintf(stderr, "usage: %s -m -g -p -U -s [WxH] -e [engine] -e [engine] -a [engine] -t [games] -P [parallel] -o [sgf] -T [startup,response,move] -k [komi] -C [cache] -j [journal] -M [bytes] -w [window] -L [text|json] -K [time] -S [address] -R [visits] -x [command]\n", argv0);
      exit(EXIT_SUCCESS);
 }
 
+/* Ask the engine playing STONE for its next move, if there is one.
+ * With a clock, its time starts running, and the engine is told how
+ * much of it is left, minus what sgo itself will take to play the
+ * move. */
+void
+request_move(enum Stone s)
+{
+     char param[32];
+     struct Time t;
+     uint64_t overhead;
+
+     if (!players[s]) {
+          return;
+     }
+
+     if (requested[s]) {
+          return;               /* still waiting for the last one */
+     }
+
+     gtp_batch_begin();
+     if (timed) {
+          clock_switch(timed, s);
+          t = clock_peek(timed, s);
+          overhead = gtp_overhead();
+          t.left = t.left > overhead ? t.left - overhead : 0;
+          snprintf(param, sizeof(param), "%c %u %u", s == BLACK ? 'b' : 'w',
+                   (unsigned) (t.left / 1000),
+                   !t.overtime ? 0 : timed->overtime == BYO_YOMI ? 1 : t.count);
+          gtp_run_command(players[s], TIME_LEFT, param, NULL);
+     }
+     requested[s] = gtp_run_command(players[s], GENMOVE,
+                                    s == BLACK ? "b" : "w",
+                                    place_bot_stone);
+
+     /* don't wait for an engine that has run out of time */
+     if (timed && requested[s]) {
+          gtp_deadline(players[s], requested[s], t.left + overhead + GRACE);
+     }
+     gtp_batch_end();
+}
+
+/* Let the engine playing against S think about its reply to the move
+ * S is expected to make, while waiting for S (see gtp_ponder).  The
+ * move is taken from the analysis, if there is one. */
+static void
+ponder(enum Stone s)
+{
+     const struct Analysis *a;
+     struct Coord c;
+
+     if (!pondering || players[s] || !players[opposite(s)]) {
+          return;
+     }
+
+     a = gtp_analysis(active_board);
+     if (a && a->updates && a->pv_len > 0 && stone_at(active_board, a->pv[0]) == NONE &&
+         valid_move(active_board, s, a->pv[0])) {
+          c = a->pv[0];
+     } else if (!player_guess(active_board, s, &c)) {
+          return;
+     }
+     gtp_ponder(players[opposite(s)], s, c);
+}
+
+/* Return true if the engine playing STONE is thinking about a move. */
+bool
+awaiting_move(enum Stone s)
+{
+     return requested[s] != 0;
+}
+
+/* Stop waiting for an engine to move, so that the user can play the
+ * move instead.  Return the colour of the move, or NONE if no engine
+ * was thinking. */
+enum Stone
+cancel_move(void)
+{
+     enum Stone s;
+
+     for (s = BLACK; s <= WHITE; s++) {
+          if (requested[s]) {
+               gtp_cancel(players[s], requested[s]);
+               requested[s] = 0;
+               return s;
+          }
+     }
+     return NONE;
+}
+
+/* Tell engine G about the time control of the game.  GTP has no
+ * notion of several byo-yomi periods, so the engine is only told
+ * about one of them. */
+static void
+time_settings(struct Gtp *g)
+{
+     if (!timed || !g) {
+          return;
+     }
+     gtp_time_settings(g, timed->main / 1000, timed->period / 1000,
+                       timed->overtime == ABSOLUTE ? 0
+                       : timed->overtime == BYO_YOMI ? 1
+                       : timed->count);
+}
+
+/* Start or stop the analysis engine, if there is one. */
+void
+toggle_analysis(void)
+{
+     if (!analyst) {
+          return;
+     }
+     if (gtp_analysis(active_board)) {
+          gtp_interrupt(analyst);
+     } else {
+          gtp_analyze(analyst, LZ_ANALYZE, ANALYSIS_INTERVAL);
+     }
+}
+
 bool
-place_bot_stone(struct Obj *o, bool error)
+place_bot_stone(struct Gtp *g, struct Obj *o, bool error)
 {
+     enum Stone s, mover = NONE;
+
+     for (s = BLACK; s <= WHITE; s++) {
+          if (players[s] == g) {
+               requested[s] = 0;
+               mover = s;
+          }
+     }
+
      if (error) {
           if (!strcmp(o->val.v_str, "invalid move\n")) {
                undo_move(active_board);
+               gtp_sync(active_board);
           }
           switch (state) {
           case QUERY_WHITE:
@@ -78,63 +229,72 @@ place_bot_stone(struct Obj *o, bool error)
      }
 
      assert(o->form == VERTEX);
-     assert(state == QUERY_WHITE || state == QUERY_BLACK);
+     if (state != QUERY_WHITE && state != QUERY_BLACK) {
+          return false;         /* e.g. the game is already over */
+     }
+     s = state == QUERY_WHITE ? WHITE : BLACK;
+     if (mover != s) {
+          return false;         /* e.g. the move was undone meanwhile */
+     }
 
      switch (o->val.v_vertex.type) {
      case RESIGN:
-          switch (state) {
-          case QUERY_WHITE:
-               S(RESIGN_BLACK);
-               return true;
-          case QUERY_BLACK:
+          if (s == WHITE) {
                S(RESIGN_WHITE);
-               return true;
-          default:
-               return false;
+          } else {
+               S(RESIGN_BLACK);
           }
+          return true;
      case PASS:
-          switch (state) {
-          case QUERY_WHITE:
-               pass(active_board, BLACK);
-               S(QUERY_WHITE);
-               return true;
-          case QUERY_BLACK:
-               pass(active_board, WHITE);
-               S(QUERY_BLACK);
+          /* two consecutive passes end the game */
+          if (!active_board->history->setup && active_board->history->pass) {
+               pass(active_board, s);
+               S(GAMEOVER);
                return true;
-          default:
-               return false;
           }
+          pass(active_board, s);
+          break;
      default:
-          ;
-     }
-
-     if (verbose) {
-          fprintf(stderr, "%s bot placing stone at (%d, %d)\n",
-                  state == QUERY_WHITE ? "white" : "black",
-                  o->val.v_vertex.coord.x,
-                  o->val.v_vertex.coord.y);
+          if (verbose) {
+               fprintf(stderr, "%s bot placing stone at (%d, %d)\n",
+                       s == WHITE ? "white" : "black",
+                       o->val.v_vertex.coord.x,
+                       o->val.v_vertex.coord.y);
+          }
+          place_stone(active_board, s, o->val.v_vertex.coord);
      }
 
-     switch (state) {
-     case QUERY_WHITE:
-          place_stone(active_board, WHITE, o->val.v_vertex.coord);
+     if (s == WHITE) {
           S(QUERY_BLACK);
-          return true;
-     case QUERY_BLACK:
-          place_stone(active_board, BLACK, o->val.v_vertex.coord);
+     } else {
           S(QUERY_WHITE);
-          return true;
-     default:
-          return false;
      }
+
+     /* in engine vs. engine games, the other engine is next */
+     request_move(opposite(s));
+     ponder(opposite(s));
+     return true;
 }
 
 static void
 cleanup(void)
 {
-     /* terminate engine */
+     if (verbose) {
+          struct HistoryStats hs = history_stats();
+          fprintf(stderr, "history: %zu moves, %zu bytes resident, "
+                  "%zu variations spilled, %zu loaded\n",
+                  hs.nodes, hs.bytes, hs.spilled, hs.loaded);
+     }
+
+     if (latency != NO_LATENCY) {
+          gtp_latency(stderr, latency == JSON);
+     }
+
+     /* terminate engines */
+     gtp_quit();
+     journal_close(active_board->journal);
      board_free(active_board);
+     cache_close();
      ui_cleanup();
 }
 
@@ -144,9 +304,17 @@ int
 main(int argc, char *argv[])
 {
      uint8_t height = 9, width = 9;
+     struct Journal *journal = NULL;
+     char *journal_file = NULL, *engines[2], *analysis = NULL;
+     size_t nengines = 0;
+     unsigned games = 0, parallel = 0, visits = 0;
+     char *sgf = NULL, *service = NULL;
+     enum Stone to_move, bot;
+     char *end;
+     int c;
 
      for (;;) {
-          switch (getopt(argc, argv, "vmDs:i:o:c:")) {
+          switch (getopt(argc, argv, "vmgpUDs:i:o:c:e:a:t:P:T:k:C:j:M:w:L:K:S:R:x:")) {
           case 's':             /* size */
                if (!sscanf(optarg, "%hhux%hhu", &height, &width)) {
                     fputs("cannot parse size\n", stderr);
@@ -156,6 +324,17 @@ main(int argc, char *argv[])
           case 'm':             /* manual game (not bot) */
                manual = true;
                break;
+          case 'g':             /* GTP engine */
+               engine = true;
+               break;
+          case 'p':             /* think on the user's time */
+               pondering = true;
+               break;
+          case 'U':             /* io_uring */
+               if (!gtp_uring()) {
+                    fputs("io_uring is not available, polling engines\n", stderr);
+               }
+               break;
           case 'c':             /* stone coolr */
                switch (optarg[0]) {
                case 'b': case 'B':
@@ -169,6 +348,119 @@ main(int argc, char *argv[])
                     exit(EXIT_FAILURE);
                }
                break;
+          case 'e':             /* engine command */
+               if (nengines == LENGTH(engines)) {
+                    fputs("at most two engines can play\n", stderr);
+                    return EXIT_FAILURE;
+               }
+               engines[nengines++] = optarg;
+               break;
+          case 'a':             /* analysis engine command */
+               analysis = optarg;
+               break;
+          case 't':             /* headless tournament */
+               games = strtoul(optarg, &end, 10);
+               if (end == optarg || *end || !games) {
+                    fputs("cannot parse number of games\n", stderr);
+                    return EXIT_FAILURE;
+               }
+               break;
+          case 'x':             /* engine specific command */
+               if (!*optarg || strpbrk(optarg, "\r\n")) {
+                    fputs("a command must be a single line\n", stderr);
+                    return EXIT_FAILURE;
+               }
+               gtp_setup(optarg);
+               break;
+          case 'R':             /* headless review */
+               visits = strtoul(optarg, &end, 10);
+               if (end == optarg || *end || !visits) {
+                    fputs("cannot parse number of visits\n", stderr);
+                    return EXIT_FAILURE;
+               }
+               break;
+          case 'P':             /* games played at once */
+               parallel = strtoul(optarg, &end, 10);
+               if (end == optarg || *end) {
+                    fputs("cannot parse number of parallel games\n", stderr);
+                    return EXIT_FAILURE;
+               }
+               break;
+          case 'o':             /* SGF output */
+               sgf = optarg;
+               break;
+          case 'T': {           /* engine timeouts */
+               unsigned startup, response = 0, move = 0;
+               if (sscanf(optarg, "%u,%u,%u", &startup, &response, &move) < 1) {
+                    fputs("cannot parse timeouts\n", stderr);
+                    return EXIT_FAILURE;
+               }
+               gtp_timeouts(startup, response, move);
+          }
+               break;
+          case 'k':             /* komi */
+               strtof(optarg, &end);
+               if (end == optarg || *end) {
+                    fputs("cannot parse komi\n", stderr);
+                    return EXIT_FAILURE;
+               }
+               komi = optarg;
+               break;
+          case 'C':             /* response cache */
+               if (!cache_open(optarg)) {
+                    return EXIT_FAILURE;
+               }
+               break;
+          case 'j':             /* game journal */
+               journal_file = optarg;
+               break;
+          case 'M': {           /* history memory budget */
+               unsigned long long budget = strtoull(optarg, &end, 10);
+               switch (*end) {
+               case 'g': case 'G':
+                    budget <<= 10;
+                    /* fallthrough */
+               case 'm': case 'M':
+                    budget <<= 10;
+                    /* fallthrough */
+               case 'k': case 'K':
+                    budget <<= 10;
+                    end++;
+               }
+               if (end == optarg || *end) {
+                    fputs("cannot parse memory budget\n", stderr);
+                    return EXIT_FAILURE;
+               }
+               history_budget(budget);
+          }
+               break;
+          case 'w':             /* commands in flight */
+               gtp_window(strtoul(optarg, &end, 10));
+               if (end == optarg || *end) {
+                    fputs("cannot parse window\n", stderr);
+                    return EXIT_FAILURE;
+               }
+               break;
+          case 'L':             /* latency statistics */
+               if (!strcmp(optarg, "text")) {
+                    latency = TEXT;
+               } else if (!strcmp(optarg, "json")) {
+                    latency = JSON;
+               } else {
+                    fputs("unknown latency format\n", stderr);
+                    return EXIT_FAILURE;
+               }
+               break;
+          case 'S':             /* pool of engines */
+               service = optarg;
+               break;
+          case 'K':             /* time control */
+               if (!clock_parse(&game_clock, optarg)) {
+                    fputs("cannot parse time control\n", stderr);
+                    return EXIT_FAILURE;
+               }
+               timed = &game_clock;
+               break;
           case 'v':
                verbose = true;
                break;
@@ -183,23 +475,112 @@ main(int argc, char *argv[])
      }
 
 init:
+     gtp_latency_on(SIGUSR1, latency == JSON);
+     if (engine) {
+          if (height != width) {
+               fputs("an engine requires a square board\n", stderr);
+               return EXIT_FAILURE;
+          }
+          return serve(height);
+     }
+     if (service) {
+          if (nengines != 1) {
+               fputs("a pool requires one engine\n", stderr);
+               return EXIT_FAILURE;
+          }
+          return pool(service, engines[0], parallel ? parallel : 1);
+     }
+     if (games) {
+          if (nengines != 2 || height != width) {
+               fputs("a tournament requires two engines and a square board\n",
+                     stderr);
+               return EXIT_FAILURE;
+          }
+          c = tournament(height, engines, games, parallel, sgf);
+          if (latency != NO_LATENCY) {
+               gtp_latency(stderr, latency == JSON);
+          }
+          return c;
+     }
+
+     if (journal_file) {
+          journal = journal_open(journal_file, height, width);
+          if (!journal) {
+               return EXIT_FAILURE;
+          }
+
+          /* resume the game with the size it was started with */
+          height = journal->width;
+          width = journal->height;
+     }
+     if (visits) {
+          if (!journal || !analysis) {
+               fputs("a review requires a journal and an analysis engine\n",
+                     stderr);
+               return EXIT_FAILURE;
+          }
+          active_board = make_board(height, width);
+          journal_replay(journal, active_board);
+          c = review(active_board, analysis, parallel, visits);
+          if (latency != NO_LATENCY) {
+               gtp_latency(stderr, latency == JSON);
+          }
+          journal_close(journal);
+          board_free(active_board);
+          return c;
+     }
+
      ui_init(height, width);
      active_board = make_board(height, width);
-     if (self == WHITE) {
+     if (journal) {
+          journal_replay(journal, active_board);
+     }
+
+     to_move = active_board->history->setup
+          ? BLACK
+          : opposite(active_board->history->player);
+     bot = self == WHITE ? BLACK : WHITE;
+     if (to_move == WHITE) {
           state = QUERY_WHITE;
      } else {
           state = QUERY_BLACK;
      }
      if (!manual) {
-          gtp_init(active_board);
-
-          /* If the user is white, we have to ask the engine to
-           * generate the first move. */
-          if (self == WHITE) {
-               gtp_run_command(active_board, GENMOVE, "w", place_bot_stone);
+          switch (nengines) {
+          case 0:               /* engine on stdin and stdout */
+               players[bot] = gtp_open(active_board, NULL);
+               break;
+          case 1:
+               players[bot] = gtp_open(active_board, engines[0]);
+               break;
+          case 2:               /* engine vs. engine */
+               players[BLACK] = gtp_open(active_board, engines[0]);
+               players[WHITE] = gtp_open(active_board, engines[1]);
+               self = NONE;
+               break;
+          }
+          if (!players[BLACK] && !players[WHITE]) {
+               fputs("cannot parse engine command\n", stderr);
+               return EXIT_FAILURE;
           }
+          time_settings(players[BLACK]);
+          time_settings(players[WHITE]);
+          if (analysis) {
+               analyst = gtp_open(active_board, analysis);
+               if (!analyst) {
+                    fputs("cannot parse analysis engine command\n", stderr);
+                    return EXIT_FAILURE;
+               }
+          }
+          gtp_sync(active_board);
+          toggle_analysis();
+
+          /* If an engine is to move (e.g. the user is white), we
+           * have to ask the engine to generate the next move. */
+          request_move(to_move);
+          ponder(to_move);
      }
-     ui_loop(active_board, &state, self, manual);
+     ui_loop(active_board, &state, self, manual, timed);
      cleanup();
 
      return EXIT_SUCCESS;
@@ -33,6 +33,9 @@ enum State {
      /* X (human or bot) has resigned the game */
      RESIGN_BLACK,
      RESIGN_WHITE,
+     /* X (human or bot) has run out of time */
+     TIMEOUT_BLACK,
+     TIMEOUT_WHITE,
      /* game is over, we are in the final state */
      GAMEOVER,
      /* stop sgo completly */
@@ -42,7 +45,7 @@ enum State {
 /* To ensure that all state transitions are valid, this table is used
  * to check if the current state may transition into a given next one
  * (see S macro below) */
-static bool valid_transition[11][11] = {
+static bool valid_transition[13][13] = {
      [CONFIRM_BLACK] = {
           [QUERY_WHITE] = true,      /* continue */
           [QUERY_BLACK] = true,      /* invalid move */
@@ -56,6 +59,7 @@ static bool valid_transition[11][11] = {
           [CONFIRM_BLACK] = true,    /* button 1 */
           [PASS_BLACK] = true,       /* button 2 */
           [RESIGN_BLACK] = true,     /* 2x button 2 */
+          [TIMEOUT_BLACK] = true,    /* out of time */
           [GAMEOVER] = true          /* mark game as over */
      },
      [QUERY_WHITE] = {
@@ -64,6 +68,7 @@ static bool valid_transition[11][11] = {
           [CONFIRM_WHITE] = true,    /* button 1 */
           [PASS_WHITE] = true,       /* button 2 */
           [RESIGN_WHITE] = true,     /* 2x button 2 */
+          [TIMEOUT_WHITE] = true,    /* out of time */
           [GAMEOVER] = true          /* mark game as over */
      },
      [PASS_BLACK] = {
@@ -78,6 +83,12 @@ static bool valid_transition[11][11] = {
      [RESIGN_WHITE] = {
           [GAMEOVER] = true          /* mark game as over */
      },
+     [TIMEOUT_BLACK] = {
+          [GAMEOVER] = true          /* mark game as over */
+     },
+     [TIMEOUT_WHITE] = {
+          [GAMEOVER] = true          /* mark game as over */
+     },
      [GAMEOVER] = {
           [GAMEOVER] = true,
      },
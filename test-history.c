@@ -0,0 +1,100 @@
+/* Test spilling variations of the game history to disk
+ *
+ * Copyright 2020-2021 Philip Kaludercic
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "board.h"
+#include "history.h"
+
+static unsigned failures;
+
+#define check(cond)                                                     \
+     do {                                                               \
+          if (!(cond)) {                                                \
+               fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+               failures++;                                              \
+          }                                                             \
+     } while (0)
+
+/* Check that every resident move below M is one deeper than its
+ * parent. */
+static void
+check_depths(struct Move *m)
+{
+     uint16_t i;
+
+     for (i = 0; i < m->children; i++) {
+          check(m->after[i]->before == m);
+          check(m->after[i]->depth == m->depth + 1);
+          if (resident(m->after[i])) {
+               check_depths(m->after[i]);
+          }
+     }
+}
+
+int
+main(void)
+{
+     struct Board *b = make_board(9, 9);
+     struct Move *root = b->history, *branch, *main_end, *m;
+
+     /* a variation of three moves after the first move... */
+     place_stone(b, BLACK, C(0, 0));
+     branch = b->history;
+     place_stone(b, WHITE, C(5, 5));
+     place_stone(b, BLACK, C(6, 6));
+     place_stone(b, WHITE, C(7, 7));
+
+     /* ...that is spilled once the main line exceeds the budget */
+     goto_move(b, branch);
+     place_stone(b, WHITE, C(1, 1));
+     place_stone(b, BLACK, C(2, 2));
+     history_budget(1);
+     place_stone(b, WHITE, C(3, 3));
+     main_end = b->history;
+     check(history_stats().spilled == 1);
+     check_depths(root);
+
+     /* following the variation again loads it */
+     goto_move(b, branch);
+     place_stone(b, WHITE, C(5, 5));
+     check(history_stats().loaded == 1);
+     check(b->history->depth == 2);
+     for (m = b->history; m->children; m = m->after[0])
+          ;
+     check(m->depth == 4);
+     check_depths(root);
+
+     /* and jumping across the loaded moves lands on the right
+      * positions */
+     goto_move(b, main_end);
+     check(b->history == main_end);
+     check(stone_at(b, C(3, 3)) == WHITE);
+     check(stone_at(b, C(7, 7)) == NONE);
+     goto_move(b, m);
+     check(stone_at(b, C(7, 7)) == WHITE);
+     check(stone_at(b, C(3, 3)) == NONE);
+
+     board_free(b);
+     if (failures) {
+          fprintf(stderr, "%u checks failed\n", failures);
+          return EXIT_FAILURE;
+     }
+     return EXIT_SUCCESS;
+}
@@ -0,0 +1,382 @@
+/* Headless engine vs. engine tournaments
+ *
+ * Copyright 2020-2021 Philip Kaludercic
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "board.h"
+#include "clock.h"
+#include "gtp.h"
+#include "tournament.h"
+
+extern bool verbose;
+extern char *komi;
+
+/* Two engines, A and B, play each other in a number of matches at
+ * once.  Every match has its own instances of both engines, which
+ * are reused for the following games, with colours swapped after
+ * every game.  sgo itself is the referee: engines are only trusted
+ * to generate moves, which are checked and recorded on a board of
+ * its own. */
+static struct Match {
+     struct Board *b;
+     struct Gtp *engine[2];     /* A and B */
+     unsigned game;             /* number of the current game */
+     bool swapped;              /* B plays black */
+     enum Stone to_move;
+     unsigned moves, passes;
+     enum { IDLE, PLAYING, OVER } status;
+     int winner;                /* 0 for A, 1 for B, -1 for a draw */
+     char result[24];           /* as in the SGF RE property */
+} *matches;
+static unsigned nmatches;
+
+/* most moves a game may last, relative to the size of the board,
+ * before it is scored as it stands */
+#define MOVE_LIMIT 3
+
+#define ENGINE(m, s) ((m)->engine[((s) == BLACK) == !(m)->swapped ? 0 : 1])
+
+static bool referee(struct Gtp *, struct Obj *, bool);
+
+static void
+request(struct Match *m)
+{
+     gtp_run_command(ENGINE(m, m->to_move), GENMOVE,
+                     m->to_move == BLACK ? "b" : "w", referee);
+}
+
+/* End the game of M, won by WINNER (NONE for a draw). */
+static void
+end(struct Match *m, enum Stone winner, const char *how)
+{
+     m->status = OVER;
+     if (winner == NONE) {
+          m->winner = -1;
+          strcpy(m->result, "0");
+     } else {
+          m->winner = ENGINE(m, winner) == m->engine[0] ? 0 : 1;
+          snprintf(m->result, sizeof(m->result), "%c+%s",
+                   winner == BLACK ? 'B' : 'W', how);
+     }
+}
+
+/* Count the points on the board of M and end the game. */
+static void
+score(struct Match *m)
+{
+     double diff = player_points(m->b, BLACK) - player_points(m->b, WHITE);
+     char how[16];
+
+     diff -= komi ? strtod(komi, NULL) : 0;
+     snprintf(how, sizeof(how), "%g", fabs(diff));
+     end(m, diff > 0 ? BLACK : diff < 0 ? WHITE : NONE, how);
+}
+
+static bool
+referee(struct Gtp *g, struct Obj *o, bool error)
+{
+     struct Match *m;
+     enum Stone s;
+     unsigned i;
+
+     for (i = 0; i < nmatches; i++) {
+          m = &matches[i];
+          if (m->status == PLAYING && ENGINE(m, m->to_move) == g) {
+               break;
+          }
+     }
+     if (i == nmatches) {
+          return false;         /* answer to an old game */
+     }
+     s = m->to_move;
+
+     if (error) {
+          fprintf(stderr, "game %u: %s failed to move: %.*s\n",
+                  m->game, gtp_name(g),
+                  (int) strcspn(o->val.v_str, "\n"), o->val.v_str);
+          end(m, opposite(s), "F");
+          return false;
+     }
+
+     switch (o->val.v_vertex.type) {
+     case RESIGN:
+          end(m, opposite(s), "R");
+          return false;
+     case PASS:
+          pass(m->b, s);
+          m->passes++;
+          break;
+     case VALID:
+          if (!valid_move(m->b, s, o->val.v_vertex.coord)) {
+               fprintf(stderr, "game %u: %s played an illegal move\n",
+                       m->game, gtp_name(g));
+               end(m, opposite(s), "F");
+               return false;
+          }
+          place_stone(m->b, s, o->val.v_vertex.coord);
+          m->passes = 0;
+          break;
+     }
+
+     m->moves++;
+     if (m->passes >= 2 ||
+         m->moves >= MOVE_LIMIT * m->b->width * m->b->height) {
+          score(m);
+          return false;
+     }
+
+     m->to_move = opposite(s);
+     request(m);
+     return false;
+}
+
+/* Write S as an SGF text value to F */
+static void
+sgf_text(FILE *f, const char *s)
+{
+     for (; s && *s; s++) {
+          if (*s == ']' || *s == '\\') {
+               fputc('\\', f);
+          }
+          fputc(*s, f);
+     }
+}
+
+/* Append the game of M to F as an SGF game tree. */
+static void
+sgf_write(FILE *f, struct Match *m)
+{
+     struct Move *mv, **path;
+     size_t n = 0, i;
+
+     for (mv = m->b->history; mv; mv = mv->before) {
+          n++;
+     }
+     path = malloc(n * sizeof(struct Move *));
+     if (!path) {
+          perror("malloc");
+          exit(EXIT_FAILURE);
+     }
+     for (i = n, mv = m->b->history; mv; mv = mv->before) {
+          path[--i] = mv;
+     }
+
+     fprintf(f, "(;GM[1]FF[4]CA[UTF-8]AP[sgo]SZ[%u]KM[%s]GN[%u]",
+             m->b->width, komi ? komi : "0", m->game);
+     fputs("PB[", f);
+     sgf_text(f, gtp_name(ENGINE(m, BLACK)));
+     fputs("]PW[", f);
+     sgf_text(f, gtp_name(ENGINE(m, WHITE)));
+     fprintf(f, "]RE[%s]\n", m->result);
+
+     for (i = 0; i < n; i++) {
+          mv = path[i];
+          if (mv->setup) {
+               continue;
+          }
+          fprintf(f, ";%c[", mv->player == BLACK ? 'B' : 'W');
+          if (!mv->pass) {
+               fprintf(f, "%c%c", 'a' + mv->placed.x, 'a' + mv->placed.y);
+          }
+          fputs("]", f);
+          if (i % 16 == 0) {
+               fputs("\n", f);
+          }
+     }
+     fputs(")\n", f);
+     fflush(f);
+
+     free(path);
+}
+
+/* Start game number GAME in match M, with a fresh board. */
+static void
+start(struct Match *m, unsigned game)
+{
+     struct Board *old = m->b;
+
+     m->b = make_board(old->height, old->width);
+     m->game = game;
+     m->swapped = game % 2 == 0;
+     m->to_move = BLACK;
+     m->moves = m->passes = 0;
+     m->status = PLAYING;
+
+     gtp_attach(m->engine[0], m->b);
+     gtp_attach(m->engine[1], m->b);
+     board_free(old);
+
+     request(m);
+}
+
+/* Print the 95% Wilson score interval of SCORE points won in N games,
+ * both as a win rate and an Elo difference. */
+static void
+statistics(double score, unsigned n)
+{
+     const double z = 1.96;
+     double p = score / n, centre, half, lo, hi;
+
+     centre = (p + z * z / (2 * n)) / (1 + z * z / n);
+     half = z * sqrt(p * (1 - p) / n + z * z / (4.0 * n * n)) / (1 + z * z / n);
+     lo = centre - half;
+     hi = centre + half;
+
+     /* rounded first, as "%+.0f" turns -0.0 and anything just below
+      * 0 into "-0" */
+#define ELO(p) (round(-400 * log10(1 / (p) - 1)) + 0.0)
+     fprintf(stderr, "A scored %.1f%% [%.1f%%, %.1f%%]",
+             100 * p, 100 * lo, 100 * hi);
+     if (lo > 0 && hi < 1) {
+          fprintf(stderr, ", Elo %+.0f [%+.0f, %+.0f]",
+                  ELO(p), ELO(lo), ELO(hi));
+     }
+     fputs("\n", stderr);
+#undef ELO
+}
+
+/* Play GAMES games on a SIZE board between the engines started by
+ * the command lines ENGINES, PARALLEL at a time, without a user
+ * interface.  Games are appended to the SGF file SGF, if given.
+ *
+ * Returns the exit status of sgo. */
+int
+tournament(uint8_t size, char *engines[2], unsigned games,
+           unsigned parallel, const char *sgf)
+{
+     unsigned wins[2] = {0}, draws = 0, finished = 0, next = 1, i, j;
+     struct pollfd *fds;
+     size_t nfds;
+     uint64_t begin;
+     double elapsed;
+     FILE *out = NULL;
+
+     if (parallel == 0) {
+          long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+          /* only one engine of a match is thinking at a time */
+          parallel = cpus > 0 ? cpus : 1;
+     }
+     if (parallel > games) {
+          parallel = games;
+     }
+     if (parallel > GTP_ENGINES / 2) {
+          parallel = GTP_ENGINES / 2;
+     }
+
+     if (sgf && !(out = fopen(sgf, "a"))) {
+          perror(sgf);
+          return EXIT_FAILURE;
+     }
+
+     nmatches = parallel;
+     matches = calloc(nmatches, sizeof(struct Match));
+     fds = calloc(nmatches * 2 * GTP_FDS, sizeof(struct pollfd));
+     if (!matches || !fds) {
+          perror("calloc");
+          exit(EXIT_FAILURE);
+     }
+
+     begin = clock_now();
+     for (i = 0; i < nmatches; i++) {
+          matches[i].b = make_board(size, size);
+          for (j = 0; j < 2; j++) {
+               matches[i].engine[j] = gtp_open(matches[i].b, engines[j]);
+               if (!matches[i].engine[j]) {
+                    fputs("cannot parse engine command\n", stderr);
+                    return EXIT_FAILURE;
+               }
+          }
+          start(&matches[i], next++);
+     }
+
+     while (finished < games) {
+          if (gtp_pending()) {
+               gtp_check_responses();
+          } else {
+               nfds = gtp_fds(fds, nmatches * 2 * GTP_FDS);
+               if (poll(fds, nfds, gtp_timeout()) < 0) {
+                    if (errno == EINTR) {
+                         continue;
+                    }
+                    perror("poll");
+                    exit(EXIT_FAILURE);
+               }
+               gtp_events(fds, nfds);
+          }
+
+          /* games are only finished here, as the engines might still
+           * be in the middle of handling responses */
+          for (i = 0; i < nmatches; i++) {
+               struct Match *m = &matches[i];
+
+               if (m->status != OVER) {
+                    continue;
+               }
+
+               finished++;
+               if (m->winner < 0) {
+                    draws++;
+               } else {
+                    wins[m->winner]++;
+               }
+               if (out) {
+                    sgf_write(out, m);
+               }
+               if (verbose) {
+                    fprintf(stderr, "game %u: %s (%s) vs. %s (%s): %s after %u moves\n",
+                            m->game,
+                            gtp_name(ENGINE(m, BLACK)), m->swapped ? "B" : "A",
+                            gtp_name(ENGINE(m, WHITE)), m->swapped ? "A" : "B",
+                            m->result, m->moves);
+               }
+
+               if (next <= games) {
+                    start(m, next++);
+               } else {
+                    m->status = IDLE;
+               }
+          }
+     }
+
+     elapsed = (clock_now() - begin) / 1000.0;
+     fprintf(stderr, "%u games: A won %u, B won %u, %u drawn\n",
+             finished, wins[0], wins[1], draws);
+     statistics(wins[0] + draws / 2.0, finished);
+     fprintf(stderr, "%.1f seconds, %.0f games/hour with %u in parallel\n",
+             elapsed, finished / elapsed * 3600, nmatches);
+
+     gtp_quit();
+     for (i = 0; i < nmatches; i++) {
+          board_free(matches[i].b);
+     }
+     free(matches);
+     free(fds);
+     if (out) {
+          fclose(out);
+     }
+
+     return EXIT_SUCCESS;
+}
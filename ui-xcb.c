@@ -20,20 +20,42 @@
 #include <assert.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 #include <poll.h>
+#include <sys/timerfd.h>
 
 #include <xcb/xcb.h>
 
 #include "board.h"
+#include "clock.h"
 #include "state.h"
 #include "gtp.h"
+#include "history.h"
+#include "journal.h"
 #include "ui.h"
 
 #define LENGTH(a) (sizeof(a)/sizeof(*a))
 
 #define MARGIN 16
 
+/* shortest time between two redraws in ms, to keep up with analysis
+ * updates without drawing more often than necessary */
+#define FRAME 66
+
+/* number of analysed moves marked on the board */
+#define CANDIDATES 5
+
+/* keysyms, see <X11/keysymdef.h> */
+#define KEY_RETURN 0xff0d
+#define KEY_ESCAPE 0xff1b
+#define KEY_HOME   0xff50
+#define KEY_LEFT   0xff51
+#define KEY_UP     0xff52
+#define KEY_RIGHT  0xff53
+#define KEY_DOWN   0xff54
+#define KEY_END    0xff57
+
 
 
 static xcb_connection_t *conn;
@@ -45,8 +67,13 @@ static xcb_gcontext_t    gc_bg;
 static xcb_gcontext_t    gc_grid;
 static xcb_gcontext_t    gc_white;
 static xcb_gcontext_t    gc_black;
+static xcb_gcontext_t    gc_text;
 
 static xcb_point_t       hover_pos;
+static enum Stone        takeover;  /* the user moves for this engine */
+
+static xcb_get_keyboard_mapping_reply_t *keymap;
+static xcb_keycode_t     min_keycode;
 
 
 
@@ -116,6 +143,15 @@ ui_init(uint8_t height, uint8_t width)
                         1,
                    }));
 
+     /* graphic context for text on the board */
+     gc_text = xcb_generate_id(conn);
+     xcb_create_gc(conn, gc_text, draw,
+                   XCB_GC_FOREGROUND | XCB_GC_BACKGROUND,
+                   ((uint32_t[]) {
+                        screen->black_pixel,
+                        screen->white_pixel,
+                   }));
+
      /* create window */
      win = xcb_generate_id(conn);
      xcb_create_window(
@@ -145,10 +181,130 @@ ui_init(uint8_t height, uint8_t width)
                          8,
                          strlen("sgo"),
                          "sgo");
+
+     /* fetch keyboard mapping, to translate key codes */
+     min_keycode = setup->min_keycode;
+     keymap = xcb_get_keyboard_mapping_reply(
+          conn,
+          xcb_get_keyboard_mapping(conn, setup->min_keycode,
+                                   setup->max_keycode - setup->min_keycode + 1),
+          NULL);
+}
+
+/* Translate key code CODE into a keysym, ignoring all modifiers. */
+static xcb_keysym_t
+ui_keysym(xcb_keycode_t code)
+{
+     xcb_keysym_t *syms;
+
+     if (!keymap || code < min_keycode) {
+          return 0;
+     }
+
+     syms = xcb_get_keyboard_mapping_keysyms(keymap);
+     if ((code - min_keycode) * keymap->keysyms_per_keycode >=
+         xcb_get_keyboard_mapping_keysyms_length(keymap)) {
+          return 0;
+     }
+     return syms[(code - min_keycode) * keymap->keysyms_per_keycode];
+}
+
+/* Jump to move M on BOARD, if the user is allowed to.  In games
+ * against an engine, the engine is brought up to date and asked to
+ * play if it's its turn. */
+static void
+ui_navigate(struct Board *b, enum State *state, enum Stone self,
+            bool manual, struct Move *m)
+{
+     enum Stone to_move;
+
+     if (!m || m == b->history) {
+          return;
+     }
+
+     /* don't navigate while an engine is about to play */
+     switch (*state) {
+     case QUERY_BLACK:
+          if (!manual && self != BLACK && awaiting_move(BLACK)) {
+               return;
+          }
+          break;
+     case QUERY_WHITE:
+          if (!manual && self != WHITE && awaiting_move(WHITE)) {
+               return;
+          }
+          break;
+     default:
+          return;
+     }
+
+     goto_move(b, m);
+
+     to_move = m->setup ? BLACK : opposite(m->player);
+     if (to_move == WHITE) {
+          S1(QUERY_WHITE);
+     } else {
+          S1(QUERY_BLACK);
+     }
+
+     gtp_sync(b);
+     if (!manual) {
+          request_move(to_move);
+     }
+     b->changed = true;
+}
+
+/* Mark the best moves according to analysis A on the empty points of
+ * board B, and describe the best move in STATUS. */
+static void
+ui_draw_analysis(struct Board *b, const struct Analysis *a,
+                 uint32_t pad_x, uint32_t pad_y, uint32_t step,
+                 char *status, size_t len)
+{
+     xcb_arc_t rings[CANDIDATES];
+     char label[8];
+     uint32_t i, n;
+     int k;
+
+     for (n = i = 0; i < b->height * b->width; i++) {
+          const struct Candidate *m = &a->move[i];
+          struct Coord c = P(b, i);
+          uint32_t x = pad_x + c.x * step, y = pad_y + c.y * step;
+
+          if (!m->visits || m->order >= CANDIDATES || stone_at(b, c) != NONE) {
+               continue;
+          }
+
+          rings[n++] = (xcb_arc_t) {
+               .x = x - step / 2 + 2,
+               .y = y - step / 2 + 2,
+               .width = step - 4,
+               .height = step - 4,
+               .angle1 = 0,
+               .angle2 = (360 << 6),
+          };
+
+          k = snprintf(label, sizeof(label), "%u", (m->winrate + 50) / 100);
+          xcb_image_text_8(conn, k, win, gc_text,
+                           x - k * 3, y + 4, label);
+
+          if (m->order == 0) {
+               char best[64];
+
+               snprintf(best, sizeof(best), " [best %c%u %u.%u%%, %u visits]",
+                        'a' + c.x + ('a' + c.x < 'i' ? 0 : 1),
+                        b->height - c.y,
+                        m->winrate / 100, m->winrate / 10 % 10,
+                        (unsigned) a->visits);
+               strncat(status, best, len - strlen(status) - 1);
+          }
+     }
+     xcb_poly_arc(conn, win, gc_black, n, rings);
 }
 
 static enum State
-ui_draw(struct Board *b, enum State state, enum Stone self, bool manual)
+ui_draw(struct Board *b, enum State state, enum Stone self, bool manual,
+        const struct Clock *clock)
 {
      char status[256];
      uint32_t height, width, i, n, step, pad_x, pad_y, dist;
@@ -229,6 +385,9 @@ ui_draw(struct Board *b, enum State state, enum Stone self, bool manual)
                     gtp_pass(b, BLACK);
                }
                S(QUERY_WHITE);
+               if (!manual) {
+                    request_move(WHITE);
+               }
                break;
           case PASS_WHITE:
                if (manual) {
@@ -237,6 +396,9 @@ ui_draw(struct Board *b, enum State state, enum Stone self, bool manual)
                     gtp_pass(b, WHITE);
                }
                S(QUERY_BLACK);
+               if (!manual) {
+                    request_move(BLACK);
+               }
                break;
           case CONFIRM_BLACK:
                if (manual) {
@@ -247,8 +409,8 @@ ui_draw(struct Board *b, enum State state, enum Stone self, bool manual)
                     }
                } else {
                     if (gtp_place_stone(b, BLACK, P(b, n))) {
-                         gtp_run_command(b, GENMOVE, "w", place_bot_stone);
                          S(QUERY_WHITE);
+                         request_move(WHITE);
                     }
                }
                break;
@@ -261,8 +423,8 @@ ui_draw(struct Board *b, enum State state, enum Stone self, bool manual)
                     }
                } else {
                     if (gtp_place_stone(b, WHITE, P(b, n))) {
-                         gtp_run_command(b, GENMOVE, "b", place_bot_stone);
                          S(QUERY_BLACK);
+                         request_move(BLACK);
                     }
                }
                break;
@@ -312,12 +474,14 @@ ui_draw(struct Board *b, enum State state, enum Stone self, bool manual)
           snprintf(status, sizeof(status), "white has played.");
           break;
      case QUERY_BLACK:
-          if (!manual && self != BLACK) {
-               snprintf(status, sizeof(status), "waiting for black");
+          if (!manual && self != BLACK && takeover != BLACK) {
+               snprintf(status, sizeof(status), awaiting_move(BLACK)
+                        ? "waiting for black (escape to play yourself)"
+                        : "black failed to move (r to retry)");
           } else {
                snprintf(status, sizeof(status), "black to play");
           }
-          if (b->history) {
+          if (!b->history->setup) {
                char update[256] = {0};
                assert(b->history->player == WHITE);
                if (b->history->pass) {
@@ -337,12 +501,14 @@ ui_draw(struct Board *b, enum State state, enum Stone self, bool manual)
           }
           break;
      case QUERY_WHITE:
-          if (!manual && self != WHITE) {
-               snprintf(status, sizeof(status), "waiting for white");
+          if (!manual && self != WHITE && takeover != WHITE) {
+               snprintf(status, sizeof(status), awaiting_move(WHITE)
+                        ? "waiting for white (escape to play yourself)"
+                        : "white failed to move (r to retry)");
           } else {
                snprintf(status, sizeof(status), "white to play");
           }
-          if (b->history) {
+          if (!b->history->setup) {
                char update[256] = {0};
                assert(b->history->player == BLACK);
                if (b->history->pass) {
@@ -367,6 +533,12 @@ ui_draw(struct Board *b, enum State state, enum Stone self, bool manual)
      case RESIGN_WHITE:
           snprintf(status, sizeof(status), "white resigned.");
           break;
+     case TIMEOUT_BLACK:
+          snprintf(status, sizeof(status), "black ran out of time.");
+          break;
+     case TIMEOUT_WHITE:
+          snprintf(status, sizeof(status), "white ran out of time.");
+          break;
      case GAMEOVER: {
           uint16_t black = player_points(b, BLACK);
           uint16_t white = player_points(b, WHITE);
@@ -394,6 +566,18 @@ ui_draw(struct Board *b, enum State state, enum Stone self, bool manual)
           .height = MARGIN,
      };
      xcb_poly_fill_rectangle(conn, win, gc_black, 1, &bar);
+     if (clock) {
+          char black[32], white[32], times[80];
+
+          clock_format(clock, BLACK, black, sizeof(black));
+          clock_format(clock, WHITE, white, sizeof(white));
+          snprintf(times, sizeof(times), " [B %s, W %s]", black, white);
+          strncat(status, times, sizeof(status) - strlen(status) - 1);
+     }
+     if (gtp_analysis(b)) {
+          ui_draw_analysis(b, gtp_analysis(b), pad_x, pad_y, step,
+                           status, sizeof(status));
+     }
      xcb_image_text_8(conn, strnlen(status, sizeof(status)),
                       win, gc_white,
                       MARGIN / 4,
@@ -405,35 +589,140 @@ ui_draw(struct Board *b, enum State state, enum Stone self, bool manual)
      return state;
 }
 
+/* Return whose turn it is in STATE, or NONE if the game is over. */
+static enum Stone
+ui_turn(enum State state)
+{
+     switch (state) {
+     case QUERY_BLACK: case CONFIRM_BLACK: case PASS_BLACK:
+          return BLACK;
+     case QUERY_WHITE: case CONFIRM_WHITE: case PASS_WHITE:
+          return WHITE;
+     default:
+          return NONE;
+     }
+}
+
+/* Keep the clock CLOCK running for the player whose turn it is in
+ * STATE, and end the game if the player has run out of time.  Timer
+ * TFD is set to expire whenever the time shown changes. */
+static void
+ui_clock(struct Board *b, enum State *state, struct Clock *clock, int tfd)
+{
+     struct itimerspec its = {0};
+     enum Stone turn = ui_turn(*state);
+     struct Time t;
+
+     if (turn != NONE && clock_peek(clock, turn).flagged) {
+          if (*state == QUERY_BLACK) {
+               S1(TIMEOUT_BLACK);
+          } else if (*state == QUERY_WHITE) {
+               S1(TIMEOUT_WHITE);
+          }
+          turn = NONE;
+          b->changed = true;
+     }
+     if (turn == clock->running) {
+          return;
+     }
+
+     clock_switch(clock, turn);
+     if (turn != NONE) {
+          /* tick whenever the seconds shown change */
+          t = clock_peek(clock, turn);
+          its.it_value.tv_nsec = (t.left % 1000 ? t.left % 1000 : 1000) * 1000000;
+          if (its.it_value.tv_nsec == 1000000000) {
+               its.it_value.tv_sec = 1;
+               its.it_value.tv_nsec = 0;
+          }
+          its.it_interval.tv_sec = 1;
+     }
+     if (timerfd_settime(tfd, 0, &its, NULL) < 0) {
+          perror("timerfd_settime");
+          exit(EXIT_FAILURE);
+     }
+     b->changed = true;
+}
+
 void
-ui_loop(struct Board *b, enum State *state, enum Stone self, bool manual)
+ui_loop(struct Board *b, enum State *state, enum Stone self, bool manual,
+        struct Clock *clock)
 {
-     struct pollfd fds[2] = {
+     struct pollfd fds[2 + GTP_FDS * GTP_ENGINES] = {
           {
-               .fd = STDIN_FILENO,
-               .events = manual ? 0 : POLLIN | POLLERR,
-          }, {
                .fd = xcb_get_file_descriptor(conn),
                .events = POLLIN | POLLERR,
           },
+          {
+               .fd = -1,        /* clock, if there is one */
+               .events = POLLIN,
+          },
      };
 
      xcb_generic_event_t *event;
+     const struct Analysis *analysis;
      xcb_timestamp_t last_pass = {0};
-     int c;
+     uint64_t frame = 0;
+     uint32_t drawn = 0;
+     uint16_t count = 0;
+     size_t n = 0;
+     int c, timeout;
+
+     if (clock) {
+          fds[1].fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+          if (fds[1].fd < 0) {
+               perror("timerfd_create");
+               exit(EXIT_FAILURE);
+          }
+     }
 
      b->changed = true;
      for (;;) {
-          fprintf(stderr, "changed: %d\n", b->changed);
+          if (clock) {
+               ui_clock(b, state, clock, fds[1].fd);
+          }
+
+          /* the user only moves for an engine once */
+          if (takeover != NONE && ui_turn(*state) != takeover) {
+               takeover = NONE;
+          }
+
+          /* redraw when new analysis arrived, but at most once a
+           * frame */
+          analysis = gtp_analysis(b);
+          timeout = 1000;
+          if (analysis && analysis->updates != drawn) {
+               if (clock_now() >= frame + FRAME) {
+                    b->changed = true;
+               } else {
+                    timeout = frame + FRAME - clock_now();
+               }
+          }
+
           if (b->changed) {
-               *state = ui_draw(b, *state, self, manual);
+               *state = ui_draw(b, *state, self, manual, clock);
+               frame = clock_now();
+               drawn = analysis ? analysis->updates : 0;
           }
 
-          c = poll(fds, LENGTH(fds), 1000);
-          fprintf(stderr, "poll() -> %d (%d)\n", c, errno);
-          if (c == 0) {
+          /* dispatch responses that didn't have to wait for the
+           * engine, before blocking */
+          if (gtp_pending()) {
+               gtp_check_responses();
                continue;
-          } if (c == -1) {
+          }
+
+          /* wake up in time to notice an engine not responding */
+          if (!manual) {
+               n = gtp_fds(fds + 2, LENGTH(fds) - 2);
+               c = gtp_timeout();
+               if (c >= 0 && c < timeout) {
+                    timeout = c;
+               }
+          }
+
+          c = poll(fds, 2 + n, timeout);
+          if (c == -1) {
                if (errno == EINTR || errno == EAGAIN) {
                     continue;
                }
@@ -441,22 +730,39 @@ ui_loop(struct Board *b, enum State *state, enum Stone self, bool manual)
                exit(EXIT_FAILURE);
           }
 
-          /* check for input on stdin */
-          if (fds[0].revents & POLLERR) {
-               perror("poll");
-               exit(EXIT_FAILURE);
+          /* check for engine input and output */
+          if (!manual) {
+               gtp_events(fds + 2, n);
           }
-          if (fds[0].revents & POLLIN) {
-               gtp_check_responses();
+
+          /* the time shown on the clock has changed */
+          if (fds[1].revents & POLLIN) {
+               uint64_t ticks;
+
+               if (read(fds[1].fd, &ticks, sizeof(ticks)) < 0 &&
+                   errno != EAGAIN) {
+                    perror("read");
+                    exit(EXIT_FAILURE);
+               }
+               b->changed = true;
+               continue;
+          }
+          if (c == 0) {
+               /* nothing happened for a while, so this is a good
+                * moment to flush the journal */
+               if (!analysis || analysis->updates == drawn) {
+                    journal_sync(b->journal);
+               }
+               continue;
           }
 
           /* check for UI input */
-          if (fds[1].revents & POLLERR) {
+          if (fds[0].revents & POLLERR) {
                perror("poll");
                exit(EXIT_FAILURE);
           }
           event = xcb_poll_for_event(conn);
-          if (!(fds[1].revents & POLLIN)) {
+          if (!(fds[0].revents & POLLIN)) {
                continue;
           }
           if (!event) {
@@ -478,14 +784,14 @@ ui_loop(struct Board *b, enum State *state, enum Stone self, bool manual)
                case XCB_BUTTON_MASK_1: /* move */
                     switch (*state) {
                     case QUERY_WHITE:
-                         if (!manual && self != WHITE) {
+                         if (!manual && self != WHITE && takeover != WHITE) {
                               break;
                          }
                          S1(CONFIRM_WHITE);
                          b->changed = true;
                          break;
                     case QUERY_BLACK:
-                         if (!manual && self != BLACK) {
+                         if (!manual && self != BLACK && takeover != BLACK) {
                               break;
                          }
                          S1(CONFIRM_BLACK);
@@ -520,7 +826,7 @@ ui_loop(struct Board *b, enum State *state, enum Stone self, bool manual)
                               b->changed = false;
                          }
                     } else {
-                         if (b && b->history && b->history->pass) {
+                         if (b && b->history->pass) {
                               S1(GAMEOVER);
                               break;
                          }
@@ -539,19 +845,25 @@ ui_loop(struct Board *b, enum State *state, enum Stone self, bool manual)
                     last_pass = press->time;
                     break;
                case XCB_BUTTON_MASK_3: /* undo */
+                    /* a move the engine is still thinking about
+                     * wouldn't fit the position after the undo */
+                    if (!manual && b->history && !b->history->setup) {
+                         cancel_move();
+                    }
                     if (undo_move(b)) {
+                         gtp_sync(b);
                          switch (*state) {
                          case QUERY_WHITE:
+                              S1(QUERY_BLACK);
                               if (!manual) {
-                                   gtp_run_command(b, GENMOVE, "b", place_bot_stone);
+                                   request_move(BLACK);
                               }
-                              S1(QUERY_BLACK);
                               break;
                          case QUERY_BLACK:
+                              S1(QUERY_WHITE);
                               if (!manual) {
-                                   gtp_run_command(b, GENMOVE, "w", place_bot_stone);
+                                   request_move(WHITE);
                               }
-                              S1(QUERY_WHITE);
                               break;
                          default:
                               ;
@@ -560,6 +872,70 @@ ui_loop(struct Board *b, enum State *state, enum Stone self, bool manual)
                     break;
                }
           }
+               break;
+          case XCB_KEY_PRESS: {
+               xcb_key_press_event_t *press = (xcb_key_press_event_t *) event;
+               xcb_keysym_t sym = ui_keysym(press->detail);
+
+               switch (sym) {
+               case KEY_HOME:
+                    ui_navigate(b, state, self, manual,
+                                history_find(b, NAV_FIRST, 0));
+                    break;
+               case KEY_END:
+                    ui_navigate(b, state, self, manual,
+                                history_find(b, NAV_LAST, 0));
+                    break;
+               case KEY_LEFT: case 'b':
+                    ui_navigate(b, state, self, manual,
+                                history_find(b, NAV_BACK, 0));
+                    break;
+               case KEY_RIGHT: case 'f':
+                    ui_navigate(b, state, self, manual,
+                                history_find(b, NAV_FORWARD, 0));
+                    break;
+               case KEY_UP: case 'p':
+                    ui_navigate(b, state, self, manual,
+                                history_find(b, NAV_PREV_VARIATION, 0));
+                    break;
+               case KEY_DOWN: case 'n':
+                    ui_navigate(b, state, self, manual,
+                                history_find(b, NAV_NEXT_VARIATION, 0));
+                    break;
+               case '0': case '1': case '2': case '3': case '4':
+               case '5': case '6': case '7': case '8': case '9':
+                    /* prefix argument for "g" */
+                    count = count * 10 + (sym - '0');
+                    break;
+               case KEY_RETURN: case 'g':
+                    ui_navigate(b, state, self, manual,
+                                history_find(b, NAV_MOVE, count));
+                    break;
+               case 'a':
+                    toggle_analysis();
+                    b->changed = true;
+                    break;
+               case KEY_ESCAPE:
+                    /* play the move the engine is thinking about */
+                    if (!manual) {
+                         takeover = cancel_move();
+                         b->changed = true;
+                    }
+                    break;
+               case 'r':
+                    /* ask an engine that failed to move again */
+                    if (!manual && ui_turn(*state) != NONE &&
+                        ui_turn(*state) != takeover) {
+                         request_move(ui_turn(*state));
+                         b->changed = true;
+                    }
+                    break;
+               }
+               if (sym < '0' || sym > '9') {
+                    count = 0;
+               }
+          }
+               break;
           }
 
           free(event);
@@ -569,6 +945,7 @@ ui_loop(struct Board *b, enum State *state, enum Stone self, bool manual)
 void
 ui_cleanup()
 {
+     free(keymap);
      xcb_free_pixmap(conn, draw);
      xcb_disconnect(conn);
 }
@@ -15,6 +15,8 @@
  */
 
 #include "board.h"
+#include "clock.h"
+#include "gtp.h"
 #include "state.h"
 
 #ifndef UI_H
@@ -22,9 +24,13 @@
 
 void ui_init(uint8_t, uint8_t);
 void ui_cleanup();
-void ui_loop(struct Board *, enum State*, enum Stone, bool);
+void ui_loop(struct Board *, enum State*, enum Stone, bool, struct Clock *);
 
 /* from sgo.c */
-bool place_bot_stone(struct Obj *o, bool error);
+bool place_bot_stone(struct Gtp *g, struct Obj *o, bool error);
+void request_move(enum Stone s);
+void toggle_analysis(void);
+bool awaiting_move(enum Stone s);
+enum Stone cancel_move(void);
 
 #endif
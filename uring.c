@@ -0,0 +1,366 @@
+/* Batched reads and writes with io_uring
+ *
+ * Copyright 2020-2021 Philip Kaludercic
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _DEFAULT_SOURCE         /* for syscall */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Requests are queued in the submission ring, and handed to the
+ * kernel all at once by a single system call, see uring_submit.
+ * Their results are taken from the completion ring without any
+ * system call at all.
+ *
+ * A read doesn't tie up a buffer while it waits for input.  The
+ * kernel picks one of the buffers provided in advance once data
+ * arrives, and the buffer is provided again when its contents have
+ * been consumed, see uring_release. */
+
+/* requests queued at once, completions kept, and read buffers */
+#define ENTRIES 1024
+#define COMPLETIONS (4 * ENTRIES)
+#define BUFFERS 256             /* a power of two */
+#define BUFSIZE 4096
+
+static int ring = -1;
+static struct {
+     unsigned *head, *tail, *array, mask;
+     struct io_uring_sqe *sqes;
+     unsigned queued;           /* tail, as far as we are concerned */
+} sq;
+static struct {
+     unsigned *head, *tail, mask;
+     struct io_uring_cqe *cqes;
+} cq;
+static void *rings;
+static size_t rings_len, sqes_len;
+
+static struct io_uring_buf_ring *provided;
+static uint16_t provided_tail;
+static char *buffers;
+
+/* Make buffer BID available to reads again. */
+static void
+provide(uint16_t bid)
+{
+     struct io_uring_buf *b = &provided->bufs[provided_tail & (BUFFERS - 1)];
+
+     b->addr = (uintptr_t) (buffers + (size_t) bid * BUFSIZE);
+     b->len = BUFSIZE;
+     b->bid = bid;
+     __atomic_store_n(&provided->tail, ++provided_tail, __ATOMIC_RELEASE);
+}
+
+/* Set up the ring, unless that has already been done.  Return false
+ * if the kernel doesn't support everything that is needed. */
+bool
+uring_open(void)
+{
+     struct io_uring_params p;
+     struct io_uring_buf_reg reg;
+     char *r;
+     uint16_t i;
+
+     if (ring >= 0) {
+          return true;
+     }
+
+     memset(&p, 0, sizeof(p));
+     p.flags = IORING_SETUP_CQSIZE;
+     p.cq_entries = COMPLETIONS;
+     ring = syscall(__NR_io_uring_setup, ENTRIES, &p);
+     if (ring < 0) {
+          return false;
+     }
+     if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+         !(p.features & IORING_FEAT_NODROP)) {
+          goto fail;
+     }
+
+     /* both rings share a single mapping */
+     rings_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+     if (rings_len < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe)) {
+          rings_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+     }
+     rings = mmap(NULL, rings_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  ring, IORING_OFF_SQ_RING);
+     if (rings == MAP_FAILED) {
+          goto fail;
+     }
+     sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+     sq.sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    ring, IORING_OFF_SQES);
+     if (sq.sqes == MAP_FAILED) {
+          munmap(rings, rings_len);
+          goto fail;
+     }
+     r = rings;
+     sq.head = (unsigned *) (r + p.sq_off.head);
+     sq.tail = (unsigned *) (r + p.sq_off.tail);
+     sq.array = (unsigned *) (r + p.sq_off.array);
+     sq.mask = *(unsigned *) (r + p.sq_off.ring_mask);
+     sq.queued = *sq.tail;
+     cq.head = (unsigned *) (r + p.cq_off.head);
+     cq.tail = (unsigned *) (r + p.cq_off.tail);
+     cq.mask = *(unsigned *) (r + p.cq_off.ring_mask);
+     cq.cqes = (struct io_uring_cqe *) (r + p.cq_off.cqes);
+
+     /* the ring of provided buffers has to be page aligned */
+     if (posix_memalign((void **) &provided, sysconf(_SC_PAGESIZE),
+                        BUFFERS * sizeof(struct io_uring_buf))) {
+          perror("posix_memalign");
+          exit(EXIT_FAILURE);
+     }
+     buffers = malloc((size_t) BUFFERS * BUFSIZE);
+     if (!buffers) {
+          perror("malloc");
+          exit(EXIT_FAILURE);
+     }
+     memset(&reg, 0, sizeof(reg));
+     reg.ring_addr = (uintptr_t) provided;
+     reg.ring_entries = BUFFERS;
+     reg.bgid = 0;
+     if (syscall(__NR_io_uring_register, ring, IORING_REGISTER_PBUF_RING,
+                 &reg, 1) < 0) {
+          munmap(sq.sqes, sqes_len);
+          munmap(rings, rings_len);
+          free(provided);
+          free(buffers);
+          goto fail;
+     }
+     provided_tail = 0;
+     for (i = 0; i < BUFFERS; i++) {
+          provide(i);
+     }
+     return true;
+
+fail:
+     close(ring);
+     ring = -1;
+     return false;
+}
+
+/* Return the descriptor of the ring, which becomes readable when
+ * requests have completed, or -1 if it hasn't been set up. */
+int
+uring_fd(void)
+{
+     return ring;
+}
+
+/* Return a cleared entry of the submission ring for a request
+ * with DATA. */
+static struct io_uring_sqe *
+queue(uint64_t data)
+{
+     struct io_uring_sqe *e;
+     unsigned i;
+
+     if (sq.queued - __atomic_load_n(sq.head, __ATOMIC_ACQUIRE) > sq.mask) {
+          uring_submit();
+     }
+     i = sq.queued++ & sq.mask;
+     e = &sq.sqes[i];
+     memset(e, 0, sizeof(*e));
+     e->user_data = data;
+     sq.array[i] = i;
+     return e;
+}
+
+/* Queue a read from FD into a provided buffer.  The completion
+ * carries DATA, which must not be 0. */
+void
+uring_read(int fd, uint64_t data)
+{
+     struct io_uring_sqe *e = queue(data);
+
+     e->opcode = IORING_OP_READ;
+     e->fd = fd;
+     e->off = (uint64_t) -1;    /* like read(2) */
+     e->len = BUFSIZE;
+     e->flags = IOSQE_BUFFER_SELECT;
+     e->buf_group = 0;
+}
+
+/* Queue a write of the N buffers of IOV to FD, which have to stay
+ * untouched until the write has completed. */
+void
+uring_writev(int fd, const struct iovec *iov, unsigned n, uint64_t data)
+{
+     struct io_uring_sqe *e = queue(data);
+
+     e->opcode = IORING_OP_WRITEV;
+     e->fd = fd;
+     e->off = (uint64_t) -1;
+     e->addr = (uintptr_t) iov;
+     e->len = n;
+}
+
+/* Queue a wait for any of the poll(2) EVENTS on FD. */
+void
+uring_poll(int fd, short events, uint64_t data)
+{
+     struct io_uring_sqe *e = queue(data);
+
+     e->opcode = IORING_OP_POLL_ADD;
+     e->fd = fd;
+     e->poll32_events = (uint16_t) events;
+}
+
+/* Cancel all requests on FD, e.g. before it is closed, and submit
+ * right away, so that no queued request outlives the descriptor.
+ * The completion of the cancellation itself carries 0. */
+void
+uring_cancel(int fd)
+{
+     struct io_uring_sqe *e = queue(0);
+
+     e->opcode = IORING_OP_ASYNC_CANCEL;
+     e->fd = fd;
+     e->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+     uring_submit();
+}
+
+/* Hand all queued requests to the kernel, without waiting for any
+ * of them to complete. */
+void
+uring_submit(void)
+{
+     unsigned n;
+
+     __atomic_store_n(sq.tail, sq.queued, __ATOMIC_RELEASE);
+     while ((n = sq.queued - __atomic_load_n(sq.head, __ATOMIC_ACQUIRE))) {
+          if (syscall(__NR_io_uring_enter, ring, n, 0, 0, NULL, 0) >= 0) {
+               continue;
+          }
+          switch (errno) {
+          case EINTR:
+               continue;
+          case EAGAIN:          /* out of memory for now, or */
+          case EBUSY:           /* too many completions not taken yet */
+               return;          /* the rest is submitted next time */
+          default:
+               perror("io_uring_enter");
+               exit(EXIT_FAILURE);
+          }
+     }
+}
+
+/* Take the next completed request from the ring into C.  If it
+ * used a provided buffer, it has to be given back by uring_release.
+ * Return false if there is none. */
+bool
+uring_next(struct Completion *c)
+{
+     unsigned head = *cq.head;
+     struct io_uring_cqe *e;
+
+     if (head == __atomic_load_n(cq.tail, __ATOMIC_ACQUIRE)) {
+          return false;
+     }
+     e = &cq.cqes[head & cq.mask];
+     c->data = e->user_data;
+     c->res = e->res;
+     c->buf = NULL;
+     if (e->flags & IORING_CQE_F_BUFFER) {
+          c->bid = e->flags >> IORING_CQE_BUFFER_SHIFT;
+          c->buf = buffers + (size_t) c->bid * BUFSIZE;
+     }
+     __atomic_store_n(cq.head, head + 1, __ATOMIC_RELEASE);
+     return true;
+}
+
+/* Give the buffer of completion C back, once its data has been
+ * consumed. */
+void
+uring_release(struct Completion *c)
+{
+     if (c->buf) {
+          provide(c->bid);
+          c->buf = NULL;
+     }
+}
+
+#else  /* io_uring is specific to Linux */
+
+bool
+uring_open(void)
+{
+     return false;
+}
+
+int
+uring_fd(void)
+{
+     return -1;
+}
+
+void
+uring_read(int fd, uint64_t data)
+{
+     (void) fd, (void) data;
+}
+
+void
+uring_writev(int fd, const struct iovec *iov, unsigned n, uint64_t data)
+{
+     (void) fd, (void) iov, (void) n, (void) data;
+}
+
+void
+uring_poll(int fd, short events, uint64_t data)
+{
+     (void) fd, (void) events, (void) data;
+}
+
+void
+uring_cancel(int fd)
+{
+     (void) fd;
+}
+
+void
+uring_submit(void)
+{
+}
+
+bool
+uring_next(struct Completion *c)
+{
+     (void) c;
+     return false;
+}
+
+void
+uring_release(struct Completion *c)
+{
+     (void) c;
+}
+
+#endif
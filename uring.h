@@ -0,0 +1,42 @@
+/* Copyright 2020-2021 Philip Kaludercic
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#ifndef URING_H
+#define URING_H
+
+/* A finished request, see uring_next */
+struct Completion {
+     uint64_t data;             /* as passed when the request was queued */
+     int32_t res;               /* result of the system call, or -errno */
+     char *buf;                 /* data read, NULL unless a read succeeded */
+     uint16_t bid;              /* buffer holding it, see uring_release */
+};
+
+bool uring_open(void);
+int uring_fd(void);
+void uring_read(int, uint64_t);
+void uring_writev(int, const struct iovec *, unsigned, uint64_t);
+void uring_poll(int, short, uint64_t);
+void uring_cancel(int);
+void uring_submit(void);
+bool uring_next(struct Completion *);
+void uring_release(struct Completion *);
+
+#endif